@@ -1,6 +1,8 @@
 #!/usr/bin/env bash
 
-gcc -o ryzen ryzen.c -lm
-gcc -o cpuf cpuf.c -lm
-gcc -o sens sens.c -lm
-gcc -o powerusage powerusage.c -lm
+gcc -o ryzen-power multicall.c ryzen.c cpuf.c sens.c powerusage.c powerlimit.c exporter.c fleet.c energy.c k10temp.c stats.c pressure.c throttle.c cpuidle.c discovery.c util.c -lm
+
+# Every tool is a symlink to the multicall binary, which dispatches on argv[0]
+for applet in ryzen cpuf sens powerusage powerlimit exporter fleet; do
+    ln -sf ryzen-power "$applet"
+done
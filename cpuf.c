@@ -2,108 +2,45 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <stdint.h>
+#include <stdbool.h>
 
-#define RAPL_FILE_PATH "/sys/class/powercap/intel-rapl:0/energy_uj"
-#define NUM_CPUS 16
+#include "cpuidle.h"
+#include "discovery.h"
+#include "energy.h"
+#include "k10temp.h"
+#include "multicall.h"
+
+#define MAX_CPUS 256
 #define BUFFER_SIZE 256
+#define USEC 1000000
 
 #define BOLD "\033[1m"
 #define RESET "\033[0m"
 
-int64_t get_cpuConsumptionUJoules()
-{
-    int64_t consumption = -1;
-    FILE *file = fopen(RAPL_FILE_PATH, "r");
-
-    if (file == NULL)
-    {
-        perror("Error opening RAPL energy file!");
-
-        return -1;
-    }
-
-    if (fscanf(file, "%lld", &consumption) != 1)
-    {
-        perror("Error reading energy consumption!");
-
-        consumption = -1;
-    }
-
-    fclose(file);
-
-    return consumption;
-}
-
-int64_t get_currentTimeUSec()
-{
-    struct timeval tv;
-
-    if (gettimeofday(&tv, NULL) != 0)
-    {
-        perror("Error getting current time!");
-
-        return -1;
-    }
-
-    return ((int64_t)tv.tv_sec * 1000000) + tv.tv_usec;
-}
+static struct energy_source energy;
+static struct energy_snapshot initial_snapshot, final_snapshot;
+static struct cpuidle idle;
+static bool has_cpuidle;
 
-float calculate_cpu_power()
+// One-second package power, with idle residency sampled on the same two timestamps
+static double calculate_cpu_power()
 {
-    int64_t initial_usage = get_cpuConsumptionUJoules();
-    int64_t initial_time = get_currentTimeUSec();
-
-    if (initial_usage == -1 || initial_time == -1)
-    {
-        fprintf(stderr, "Failed to read initial CPU consumption or time data!\n");
-
-        return -1.0f;
-    }
-
-    usleep(1000000);
-
-    int64_t final_usage = get_cpuConsumptionUJoules();
-    int64_t final_time = get_currentTimeUSec();
-
-    if (final_usage == -1 || final_time == -1)
-    {
-        fprintf(stderr, "Failed to read final CPU consumption or time data!\n");
-
-        return -1.0f;
-    }
-
-    if (final_time < initial_time)
-    {
-        fprintf(stderr, "Time went backwards!\n");
-
-        return -1.0f;
-    }
-
-    int64_t time_diff_usec = final_time - initial_time;
-    int64_t energy_diff_uj = final_usage - initial_usage;
-
-    if (time_diff_usec <= 0)
-    {
-        fprintf(stderr, "Invalid time difference!\n");
-
-        return -1.0f;
-    }
+    if (energy_window_start(&energy, &initial_snapshot) != 0)
+        return -1.0;
 
-    if (energy_diff_uj < 0)
-    {
-        fprintf(stderr, "Energy consumption decreased!\n");
+    if (has_cpuidle)
+        cpuidle_sample(&idle, initial_snapshot.usec);
 
-        return -1.0f;
-    }
+    double watts = energy_window_end(&energy, &initial_snapshot, USEC, &final_snapshot);
 
-    double time_diff_sec = time_diff_usec / 1000000.0;
+    if (has_cpuidle)
+        cpuidle_sample(&idle, final_snapshot.usec);
 
-    return (float)(energy_diff_uj / (time_diff_sec * 1e6));
+    return watts;
 }
 
-int read_int_from_file(const char *path)
+static int read_int_from_file(const char *path)
 {
     int value = 0;
     FILE *file = fopen(path, "r");
@@ -129,105 +66,77 @@ int read_int_from_file(const char *path)
     return value;
 }
 
-int read_int_from_command(const char *command)
+// One row per CCD: share of the power window spent in C0 and in each idle state
+static void print_idle_summary()
 {
-    FILE *fp;
-    char output[BUFFER_SIZE];
-    int value = -1;
+    struct cpuidle_summary summary;
 
-    fp = popen(command, "r");
+    printf("Idle    :   C0");
 
-    if (fp == NULL)
-    {
-        perror("Error running command!");
+    for (int s = 0; s < idle.num_states; s++)
+        printf(" %5.5s", idle.state_names[s]);
 
-        return -1;
-    }
+    printf("  wakeups\n");
 
-    if (fgets(output, sizeof(output), fp) != NULL)
+    for (int ccd = 0; ccd < idle.num_ccds; ccd++)
     {
-        char *endptr;
-        value = strtol(output, &endptr, 10);
+        if (cpuidle_ccd_summary(&idle, ccd, &summary) != 0)
+            continue;
 
-        if (*endptr != '\0')
-        {
-            fprintf(stderr, "Error converting command output to integer!\n");
+        printf("CCD %-4d: %3.0f%%", ccd, summary.active_share * 100);
 
-            value = -1;
-        }
-    }
-    else
-    {
-        perror("Error reading output from command!");
-    }
+        for (int s = 0; s < idle.num_states; s++)
+            printf(" %4.0f%%", summary.state_share[s] * 100);
 
-    pclose(fp);
+        printf(" %7.0f/s\n", summary.wakeups_per_s);
+    }
 
-    return value;
+    printf("\n");
 }
 
-int main()
+int cpuf_main(int argc, char *argv[])
 {
-    char hwmon_path[BUFFER_SIZE];
-    FILE *fp;
-    int cpu_tctl = -1, cpu_tccd = -1;
-    float cpu_power = -1.0f;
-    int cpu_freq[NUM_CPUS];
+    (void)argc;
+    (void)argv;
 
-    fp = popen("grep -l 'k10temp' /sys/class/hwmon/hwmon*/name", "r");
+    struct k10temp kt;
+    double cpu_power = -1.0;
+    int cpu_freq[MAX_CPUS];
+    int num_cpus = discovery_get()->num_cpus < MAX_CPUS ? discovery_get()->num_cpus : MAX_CPUS;
 
-    if (fp == NULL || fgets(hwmon_path, sizeof(hwmon_path), fp) == NULL)
+    if (k10temp_open(&kt) != 0)
     {
         printf("k10temp sensor module not found!\n");
 
-        pclose(fp);
-
         return 1;
     }
 
-    pclose(fp);
-
-    hwmon_path[strcspn(hwmon_path, "\n")] = 0;
-
-    size_t len = strlen(hwmon_path);
-
-    if (len > 5)
+    if (k10temp_read(&kt) != 0)
     {
-        hwmon_path[len - 5] = '\0';
-    }
-    else
-    {
-        fprintf(stderr, "Invalid hwmon_path format!\n");
+        printf("Failed to read temperatures!\n");
 
         return 1;
     }
 
-    char temp1_path[BUFFER_SIZE];
-    char temp3_path[BUFFER_SIZE];
-
-    snprintf(temp1_path, sizeof(temp1_path), "%s/temp1_input", hwmon_path);
-    snprintf(temp3_path, sizeof(temp3_path), "%s/temp3_input", hwmon_path);
-
-    cpu_tctl = read_int_from_file(temp1_path) / 1000;
-    cpu_tccd = read_int_from_file(temp3_path) / 1000;
-
-    if (cpu_tctl == -1 || cpu_tccd == -1)
+    // The energy backend goes first, cpuidle holds two fds per CPU and state
+    if (energy_open(&energy) != 0)
     {
-        printf("Failed to read temperatures!\n");
+        printf("Failed to calculate CPU power!\n");
 
         return 1;
     }
 
+    has_cpuidle = cpuidle_open(&idle) == 0;
     cpu_power = calculate_cpu_power();
 
-    if (cpu_power == -1.0f)
+    if (cpu_power < 0)
     {
         printf("Failed to calculate CPU power!\n");
 
         return 1;
     }
 
-    for (int i = 0; i < NUM_CPUS; i++)
+    for (int i = 0; i < num_cpus; i++)
     {
         char freq_path[BUFFER_SIZE];
 
@@ -237,15 +146,32 @@ int main()
     }
 
     printf("\n" BOLD "Ryzen 7 7800X3D" RESET "\n\n");
-    printf("Tctl    : %8d°C\n", cpu_tctl);
-    printf("Tccd    : %8d°C\n", cpu_tccd);
+    printf("Tctl    : %8d°C\n", kt.tctl_mc / 1000);
+
+    // The hottest CCD is printed in bold when there is more than one
+    for (int i = 0; i < kt.num_ccds; i++)
+    {
+        bool hottest = kt.num_ccds > 1 && i == kt.hottest;
+
+        printf("%sTccd%-2d  : %8d°C%s\n", hottest ? BOLD : "", kt.ccd_ids[i], kt.ccd_mc[i] / 1000, hottest ? RESET : "");
+    }
+
     printf("Power   : %8.2f W\n", cpu_power);
+
+    for (int i = 0; energy.num_packages > 1 && i < energy.num_packages; i++)
+        printf("Socket %d: %8.2f W\n", i, energy_watts(&initial_snapshot, &final_snapshot, i));
+
     printf("\n");
 
-    for (int i = 0; i < NUM_CPUS; i++)
+    if (has_cpuidle)
+        print_idle_summary();
+
+    for (int i = 0; i < num_cpus; i++)
     {
         printf("CPU %2d  : %6d MHz\n", i + 1, cpu_freq[i]);
     }
 
+    k10temp_close(&kt);
+
     return 0;
 }
@@ -0,0 +1,235 @@
+#include "cpuidle.h"
+#include "discovery.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define CPU_PATH "/sys/devices/system/cpu"
+#define BUFFER_SIZE 128
+#define USEC 1000000
+
+// CCDs are identified by the L3 they share, cached from cpuN/cache/index3/id
+static int find_ccd(struct cpuidle *ci, int cpu)
+{
+    const struct discovery *d = discovery_get();
+    int l3_id = cpu < d->num_cpus ? d->l3_ids[cpu] : 0;
+    int ccd = 0;
+
+    while (ccd < ci->num_ccds && ci->ccd_ids[ccd] != l3_id)
+        ccd++;
+
+    if (ccd == ci->num_ccds && ci->num_ccds < CPUIDLE_MAX_CCDS)
+        ci->ccd_ids[ci->num_ccds++] = l3_id;
+
+    return ccd < CPUIDLE_MAX_CCDS ? ccd : CPUIDLE_MAX_CCDS - 1;
+}
+
+static void close_cpu(struct cpuidle_cpu *cpu)
+{
+    for (int s = 0; s < cpu->num_states; s++)
+    {
+        close(cpu->time_fds[s]);
+
+        if (cpu->usage_fds[s] >= 0)
+            close(cpu->usage_fds[s]);
+    }
+
+    cpu->num_states = 0;
+}
+
+// Two fds per CPU and state: 256 threads with 3 states is past the usual soft limit of 1024
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int cpuidle_open(struct cpuidle *ci)
+{
+    char path[BUFFER_SIZE];
+    int num_cpus = discovery_get()->num_cpus;
+    int failed = 0, first_failed = -1, first_error = 0;
+
+    memset(ci, 0, sizeof(*ci));
+    raise_fd_limit();
+
+    for (int n = 0; n < num_cpus && ci->num_cpus < CPUIDLE_MAX_CPUS; n++)
+    {
+        struct cpuidle_cpu *cpu = &ci->cpus[ci->num_cpus];
+        int error = 0;
+
+        cpu->num_states = 0;
+
+        for (int s = 0; s < CPUIDLE_MAX_STATES; s++)
+        {
+            snprintf(path, sizeof(path), CPU_PATH "/cpu%d/cpuidle/state%d/time", n, s);
+
+            // ENOENT is the end of the state list (or an offline CPU), anything else is a real failure
+            if ((cpu->time_fds[s] = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            {
+                error = errno != ENOENT ? errno : 0;
+
+                break;
+            }
+
+            snprintf(path, sizeof(path), CPU_PATH "/cpu%d/cpuidle/state%d/usage", n, s);
+            cpu->usage_fds[s] = open(path, O_RDONLY | O_CLOEXEC);
+            cpu->num_states++;
+
+            if (cpu->usage_fds[s] < 0 && errno != ENOENT)
+            {
+                error = errno;
+
+                break;
+            }
+
+            if (s >= ci->num_states)
+            {
+                snprintf(path, sizeof(path), CPU_PATH "/cpu%d/cpuidle/state%d/name", n, s);
+
+                if (read_line(path, ci->state_names[s], sizeof(ci->state_names[s])) != 0)
+                    snprintf(ci->state_names[s], sizeof(ci->state_names[s]), "S%d", s);
+
+                ci->num_states = s + 1;
+            }
+        }
+
+        // A CPU missing some of its states would show their residency as C0, leave it out entirely
+        if (error)
+        {
+            if (failed++ == 0)
+            {
+                first_failed = n;
+                first_error = error;
+            }
+
+            close_cpu(cpu);
+
+            continue;
+        }
+
+        // Offline CPUs have no cpuidle directory
+        if (cpu->num_states == 0)
+            continue;
+
+        cpu->ccd = find_ccd(ci, n);
+        ci->num_cpus++;
+    }
+
+    if (failed)
+        fprintf(stderr, "cpuidle: %d CPUs left out of the idle summary, first cpu%d: %s\n", failed, first_failed, strerror(first_error));
+
+    return ci->num_cpus > 0 ? 0 : -1;
+}
+
+void cpuidle_close(struct cpuidle *ci)
+{
+    for (int i = 0; i < ci->num_cpus; i++)
+        close_cpu(&ci->cpus[i]);
+
+    ci->num_cpus = 0;
+}
+
+/*
+ * One pass over every open fd. usec is the caller's CLOCK_MONOTONIC
+ * timestamp for this sample (energy_source.sample_usec), 0 to take a fresh one.
+ */
+int cpuidle_sample(struct cpuidle *ci, int64_t usec)
+{
+    int failed = 0;
+
+    if (usec == 0)
+    {
+        struct timespec time;
+
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        usec = (int64_t)time.tv_sec * USEC + time.tv_nsec / 1000;
+    }
+
+    ci->previous_usec = ci->sample_usec;
+    ci->sample_usec = usec;
+
+    for (int i = 0; i < ci->num_cpus; i++)
+    {
+        struct cpuidle_cpu *cpu = &ci->cpus[i];
+
+        memcpy(cpu->previous_time_us, cpu->time_us, sizeof(cpu->time_us));
+        memcpy(cpu->previous_usage, cpu->usage, sizeof(cpu->usage));
+
+        for (int s = 0; s < cpu->num_states; s++)
+        {
+            if ((cpu->time_us[s] = read_int64_fd(cpu->time_fds[s])) < 0)
+                failed++;
+
+            cpu->usage[s] = cpu->usage_fds[s] >= 0 ? read_int64_fd(cpu->usage_fds[s]) : 0;
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+
+/*
+ * Average over the CPUs of one CCD for the last window. Whatever time no idle
+ * state accounts for is reported as C0 (active).
+ */
+int cpuidle_ccd_summary(const struct cpuidle *ci, int ccd, struct cpuidle_summary *summary)
+{
+    int64_t window = ci->sample_usec - ci->previous_usec;
+    int64_t wakeups = 0;
+    double idle = 0.0;
+
+    memset(summary, 0, sizeof(*summary));
+
+    if (ci->previous_usec <= 0 || window <= 0)
+        return -1;
+
+    for (int i = 0; i < ci->num_cpus; i++)
+    {
+        const struct cpuidle_cpu *cpu = &ci->cpus[i];
+
+        if (cpu->ccd != ccd)
+            continue;
+
+        for (int s = 0; s < cpu->num_states; s++)
+        {
+            int64_t delta = cpu->time_us[s] - cpu->previous_time_us[s];
+
+            if (delta > 0)
+                summary->state_share[s] += (double)delta / window;
+
+            wakeups += cpu->usage[s] - cpu->previous_usage[s];
+        }
+
+        summary->cpus++;
+    }
+
+    if (summary->cpus == 0)
+        return -1;
+
+    for (int s = 0; s < ci->num_states; s++)
+    {
+        // Residency is sampled a few µs apart from the timestamp, keep shares sane
+        summary->state_share[s] /= summary->cpus;
+
+        if (summary->state_share[s] > 1.0)
+            summary->state_share[s] = 1.0;
+
+        idle += summary->state_share[s];
+    }
+
+    summary->active_share = idle < 1.0 ? 1.0 - idle : 0.0;
+    summary->wakeups_per_s = wakeups > 0 ? (double)wakeups * USEC / window : 0.0;
+
+    return 0;
+}
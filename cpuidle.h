@@ -0,0 +1,55 @@
+#ifndef CPUIDLE_H
+#define CPUIDLE_H
+
+#include <stdint.h>
+
+#define CPUIDLE_MAX_CPUS 256
+#define CPUIDLE_MAX_STATES 10
+#define CPUIDLE_MAX_CCDS 16
+#define CPUIDLE_NAME_LENGTH 16
+
+struct cpuidle_cpu
+{
+    int ccd;
+    int num_states;
+    int time_fds[CPUIDLE_MAX_STATES];
+    int usage_fds[CPUIDLE_MAX_STATES];
+    int64_t time_us[CPUIDLE_MAX_STATES];
+    int64_t usage[CPUIDLE_MAX_STATES];
+    int64_t previous_time_us[CPUIDLE_MAX_STATES];
+    int64_t previous_usage[CPUIDLE_MAX_STATES];
+};
+
+struct cpuidle_summary
+{
+    int cpus;
+    double active_share;
+    double state_share[CPUIDLE_MAX_STATES];
+    double wakeups_per_s;
+};
+
+/*
+ * cpuN/cpuidle/stateX/{time,usage} for every CPU, opened once and re-read
+ * with pread() in a single pass per cpuidle_sample(). CPUs are grouped into
+ * CCDs by the L3 they share (cache/index3/id). Shares cover the window
+ * between the last two samples; passing the RAPL sample timestamp makes that
+ * the same window as the power figure.
+ */
+struct cpuidle
+{
+    struct cpuidle_cpu cpus[CPUIDLE_MAX_CPUS];
+    int num_cpus;
+    char state_names[CPUIDLE_MAX_STATES][CPUIDLE_NAME_LENGTH];
+    int num_states;
+    int ccd_ids[CPUIDLE_MAX_CCDS];
+    int num_ccds;
+    int64_t sample_usec;
+    int64_t previous_usec;
+};
+
+int cpuidle_open(struct cpuidle *ci);
+void cpuidle_close(struct cpuidle *ci);
+int cpuidle_sample(struct cpuidle *ci, int64_t usec);
+int cpuidle_ccd_summary(const struct cpuidle *ci, int ccd, struct cpuidle_summary *summary);
+
+#endif
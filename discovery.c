@@ -0,0 +1,328 @@
+#include "discovery.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HWMON_PATH "/sys/class/hwmon"
+#define CPU_PATH "/sys/devices/system/cpu"
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+#define CACHE_ENV "RYZEN_POWER_CACHE"
+#define CACHE_DIR "ryzen-power"
+#define CACHE_FILE "discovery"
+#define DISCOVERY_MAGIC 0x31435052
+#define BUFFER_SIZE 256
+
+static struct discovery discovery;
+static bool loaded;
+static bool from_cache;
+
+static int cache_path(char *path, size_t size, bool create)
+{
+    const char *override = getenv(CACHE_ENV);
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char dir[BUFFER_SIZE];
+
+    if (override && *override)
+        return snprintf(path, size, "%s", override) < (int)size ? 0 : -1;
+
+    if (xdg && *xdg)
+        snprintf(dir, sizeof(dir), "%s", xdg);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+        return -1;
+
+    if (create)
+        mkdir(dir, 0755);
+
+    size_t len = strlen(dir);
+
+    snprintf(dir + len, sizeof(dir) - len, "/" CACHE_DIR);
+
+    if (create)
+        mkdir(dir, 0755);
+
+    return snprintf(path, size, "%s/" CACHE_FILE, dir) < (int)size ? 0 : -1;
+}
+
+/*
+ * Order-independent fingerprint of the hwmonN entries: one getdents, no
+ * per-chip reads. Sysfs does not reliably bump the directory mtime on
+ * hotplug, so chips coming, going or being renumbered are caught here instead.
+ */
+static uint64_t hwmon_signature()
+{
+    DIR *dir = opendir(HWMON_PATH);
+    struct dirent *entry;
+    uint64_t signature = 0;
+
+    if (!dir)
+        return 0;
+
+    while ((entry = readdir(dir)))
+    {
+        if (strncmp(entry->d_name, "hwmon", 5) != 0)
+            continue;
+
+        // splitmix64 finalizer, summed so readdir order does not matter
+        uint64_t x = (uint64_t)atoi(entry->d_name + 5) + 0x9e3779b97f4a7c15ULL;
+
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        signature += x ^ (x >> 31);
+    }
+
+    closedir(dir);
+
+    return signature;
+}
+
+static int compare_hwmon(const void *a, const void *b)
+{
+    return ((const struct discovery_hwmon *)a)->number - ((const struct discovery_hwmon *)b)->number;
+}
+
+// hwmon numbering follows probe order, sorting keeps "@N" instances stable between runs
+static void discover_hwmon(struct discovery *d)
+{
+    DIR *dir = opendir(HWMON_PATH);
+    struct dirent *entry;
+    char path[BUFFER_SIZE];
+
+    if (!dir)
+        return;
+
+    while ((entry = readdir(dir)) && d->num_hwmon < DISCOVERY_MAX_HWMON)
+    {
+        struct discovery_hwmon *hwmon = &d->hwmon[d->num_hwmon];
+
+        if (strncmp(entry->d_name, "hwmon", 5) != 0)
+            continue;
+
+        snprintf(path, sizeof(path), HWMON_PATH "/%.32s/name", entry->d_name);
+
+        if (read_line(path, hwmon->name, sizeof(hwmon->name)) != 0)
+            continue;
+
+        hwmon->number = atoi(entry->d_name + 5);
+        hwmon->instance = 0;
+        hwmon->model[0] = '\0';
+
+        // NVMe drives are named after their model, not the "nvme" chip
+        snprintf(path, sizeof(path), HWMON_PATH "/%.32s/device/model", entry->d_name);
+        read_line(path, hwmon->model, sizeof(hwmon->model));
+        d->num_hwmon++;
+    }
+
+    closedir(dir);
+
+    qsort(d->hwmon, d->num_hwmon, sizeof(d->hwmon[0]), compare_hwmon);
+
+    for (int i = 0; i < d->num_hwmon; i++)
+        for (int j = 0; j < i; j++)
+            if (strcmp(d->hwmon[i].name, d->hwmon[j].name) == 0)
+                d->hwmon[i].instance++;
+}
+
+// CCDs are identified by the L3 they share, cpuN/cache/index3/id
+static void discover_topology(struct discovery *d)
+{
+    char path[BUFFER_SIZE], buffer[32];
+
+    for (d->num_cpus = 0; d->num_cpus < DISCOVERY_MAX_CPUS; d->num_cpus++)
+    {
+        snprintf(path, sizeof(path), CPU_PATH "/cpu%d/cache/index3/id", d->num_cpus);
+
+        if (read_line(path, buffer, sizeof(buffer)) == 0)
+            d->l3_ids[d->num_cpus] = atoi(buffer);
+        else
+        {
+            snprintf(path, sizeof(path), CPU_PATH "/cpu%d", d->num_cpus);
+
+            if (access(path, F_OK) != 0)
+                break;
+
+            d->l3_ids[d->num_cpus] = 0;
+        }
+    }
+}
+
+static void save()
+{
+    char path[BUFFER_SIZE], temp[BUFFER_SIZE + 8];
+
+    if (cache_path(path, sizeof(path), true) != 0)
+        return;
+
+    snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+
+    // Never through a planted symlink or someone else's file; a stale temp of our own is replaced once
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+
+    if (fd < 0 && errno == EEXIST && unlink(temp) == 0)
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+
+    if (fd < 0)
+        return;
+
+    // Written whole and renamed, so a concurrent start never reads half a cache
+    if (write(fd, &discovery, sizeof(discovery)) != (ssize_t)sizeof(discovery) || close(fd) != 0 || rename(temp, path) != 0)
+        unlink(temp);
+}
+
+static void rediscover(const char *boot_id, uint64_t signature)
+{
+    memset(&discovery, 0, sizeof(discovery));
+    discovery.magic = DISCOVERY_MAGIC;
+    discovery.size = sizeof(discovery);
+    snprintf(discovery.boot_id, sizeof(discovery.boot_id), "%s", boot_id);
+    discovery.hwmon_signature = signature;
+    discovery.k10temp_hwmon = -1;
+    discovery.energy_backend = ENERGY_NONE;
+
+    discover_hwmon(&discovery);
+    discover_topology(&discovery);
+    save();
+}
+
+static bool terminated(const char *string, size_t size)
+{
+    return memchr(string, '\0', size) != NULL;
+}
+
+/*
+ * Counts and indices from the file bound array accesses and loops in every
+ * module, and names go to strcmp(): a truncated, corrupted or hand-edited
+ * cache has to fail here rather than be trusted.
+ */
+static bool valid(const struct discovery *d)
+{
+    if (d->num_hwmon < 0 || d->num_hwmon > DISCOVERY_MAX_HWMON || d->num_cpus < 0 || d->num_cpus > DISCOVERY_MAX_CPUS ||
+        d->k10temp_hwmon < -1 || d->k10temp_hwmon >= d->num_hwmon || d->k10temp_num_ccds < 0 || d->k10temp_num_ccds > DISCOVERY_MAX_CCDS ||
+        d->energy_backend < ENERGY_NONE || d->energy_backend > ENERGY_MSR)
+        return false;
+
+    for (int i = 0; i < d->num_hwmon; i++)
+        if (!terminated(d->hwmon[i].name, sizeof(d->hwmon[i].name)) || !terminated(d->hwmon[i].model, sizeof(d->hwmon[i].model)))
+            return false;
+
+    return true;
+}
+
+static int load(const char *boot_id, uint64_t signature)
+{
+    char path[BUFFER_SIZE];
+
+    if (cache_path(path, sizeof(path), false) != 0)
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    ssize_t len = read(fd, &discovery, sizeof(discovery));
+
+    close(fd);
+
+    if (len != (ssize_t)sizeof(discovery) || discovery.magic != DISCOVERY_MAGIC || discovery.size != sizeof(discovery) ||
+        !terminated(discovery.boot_id, sizeof(discovery.boot_id)) || strcmp(discovery.boot_id, boot_id) != 0 ||
+        discovery.hwmon_signature != signature || !valid(&discovery))
+        return -1;
+
+    return 0;
+}
+
+/*
+ * The shared init: one read of the cache file, a boot ID read and a listing
+ * of /sys/class/hwmon on a warm start, the full sysfs walk (and a rewrite of the cache) otherwise.
+ */
+const struct discovery *discovery_get(void)
+{
+    char boot_id[40] = "";
+
+    if (loaded)
+        return &discovery;
+
+    read_line(BOOT_ID_PATH, boot_id, sizeof(boot_id));
+
+    uint64_t signature = hwmon_signature();
+
+    from_cache = load(boot_id, signature) == 0;
+
+    if (!from_cache)
+        rediscover(boot_id, signature);
+
+    loaded = true;
+
+    return &discovery;
+}
+
+bool discovery_cached(void)
+{
+    return loaded && from_cache;
+}
+
+void discovery_invalidate(void)
+{
+    char path[BUFFER_SIZE];
+
+    if (cache_path(path, sizeof(path), false) == 0)
+        unlink(path);
+
+    loaded = false;
+    discovery_get();
+}
+
+void discovery_set_energy_backend(enum energy_backend backend)
+{
+    discovery_get();
+
+    if (discovery.energy_backend == backend)
+        return;
+
+    discovery.energy_backend = backend;
+    save();
+}
+
+void discovery_set_k10temp(int hwmon, int tctl_channel, const int *ccd_channels, const int *ccd_ids, int num_ccds)
+{
+    discovery_get();
+
+    discovery.k10temp_known = true;
+    discovery.k10temp_hwmon = hwmon;
+    discovery.k10temp_tctl_channel = tctl_channel;
+    discovery.k10temp_num_ccds = num_ccds < DISCOVERY_MAX_CCDS ? num_ccds : DISCOVERY_MAX_CCDS;
+
+    for (int i = 0; i < discovery.k10temp_num_ccds; i++)
+    {
+        discovery.k10temp_ccd_channels[i] = ccd_channels[i];
+        discovery.k10temp_ccd_ids[i] = ccd_ids[i];
+    }
+
+    save();
+}
+
+const struct discovery_hwmon *discovery_find_hwmon(const char *name, int instance)
+{
+    const struct discovery *d = discovery_get();
+
+    for (int i = 0; i < d->num_hwmon; i++)
+        if (strcmp(d->hwmon[i].name, name) == 0 && d->hwmon[i].instance == instance)
+            return &d->hwmon[i];
+
+    return NULL;
+}
+
+void discovery_hwmon_path(const struct discovery_hwmon *hwmon, char *path, size_t size)
+{
+    snprintf(path, size, HWMON_PATH "/hwmon%d", hwmon->number);
+}
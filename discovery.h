@@ -0,0 +1,61 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "energy.h"
+
+#define DISCOVERY_MAX_HWMON 64
+#define DISCOVERY_MAX_CPUS 256
+#define DISCOVERY_MAX_CCDS 12
+#define DISCOVERY_NAME_LENGTH 32
+#define DISCOVERY_MODEL_LENGTH 64
+// Enough for discovery_hwmon_path(): "/sys/class/hwmon/hwmon" and a number
+#define DISCOVERY_PATH_LENGTH 64
+
+struct discovery_hwmon
+{
+    int number;
+    int instance;
+    char name[DISCOVERY_NAME_LENGTH];
+    char model[DISCOVERY_MODEL_LENGTH];
+};
+
+/*
+ * Everything the tools used to rediscover on every start: hwmon chips (with
+ * NVMe models), the k10temp channel map, the RAPL backend that worked and the
+ * CPU topology. It is persisted as a flat struct in the user's cache dir and
+ * trusted while the boot ID and the set of hwmonN entries match. The
+ * k10temp map and RAPL backend are filled in by their modules on first use;
+ * a module that finds a cached path gone calls discovery_invalidate().
+ */
+struct discovery
+{
+    uint32_t magic;
+    uint32_t size;
+    char boot_id[40];
+    uint64_t hwmon_signature;
+    struct discovery_hwmon hwmon[DISCOVERY_MAX_HWMON];
+    int num_hwmon;
+    bool k10temp_known;
+    int k10temp_hwmon;
+    int k10temp_tctl_channel;
+    int k10temp_ccd_channels[DISCOVERY_MAX_CCDS];
+    int k10temp_ccd_ids[DISCOVERY_MAX_CCDS];
+    int k10temp_num_ccds;
+    enum energy_backend energy_backend;
+    int num_cpus;
+    int l3_ids[DISCOVERY_MAX_CPUS];
+};
+
+const struct discovery *discovery_get(void);
+bool discovery_cached(void);
+void discovery_invalidate(void);
+void discovery_set_energy_backend(enum energy_backend backend);
+void discovery_set_k10temp(int hwmon, int tctl_channel, const int *ccd_channels, const int *ccd_ids, int num_ccds);
+const struct discovery_hwmon *discovery_find_hwmon(const char *name, int instance);
+void discovery_hwmon_path(const struct discovery_hwmon *hwmon, char *path, size_t size);
+
+#endif
@@ -0,0 +1,514 @@
+#include "energy.h"
+#include "discovery.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_POWER_PATH "/sys/bus/event_source/devices/power"
+#define POWERCAP_PATH "/sys/class/powercap"
+#define CPU_PATH "/sys/devices/system/cpu"
+#define MAX_CPUS 1024
+#define BUFFER_SIZE 256
+#define ZONE_PATH_SIZE 64
+#define USEC 1000000
+
+#define AMD_MSR_RAPL_POWER_UNIT 0xC0010299
+#define AMD_MSR_PKG_ENERGY_STATUS 0xC001029B
+#define INTEL_MSR_RAPL_POWER_UNIT 0x606
+#define INTEL_MSR_PKG_ENERGY_STATUS 0x611
+#define INTEL_MSR_PP0_ENERGY_STATUS 0x639
+#define MSR_ENERGY_MASK 0xFFFFFFFFLL
+
+static void counter_reset(struct energy_counter *counter, int package, const char *name)
+{
+    counter->fd = -1;
+    counter->package = package;
+    counter->config = 0;
+    counter->scale_uj = 1.0;
+    counter->range = 0;
+    counter->last_raw = 0;
+    counter->total = 0;
+    counter->uj = 0;
+    snprintf(counter->name, sizeof(counter->name), "%s", name);
+}
+
+static int64_t counter_raw(enum energy_backend backend, const struct energy_counter *counter)
+{
+    uint64_t value;
+    char buffer[32];
+    ssize_t len;
+
+    switch (backend)
+    {
+        case ENERGY_PERF:
+            // A single read() on the persistent fd returns the 64-bit count
+            if (read(counter->fd, &value, sizeof(value)) != sizeof(value))
+                return -1;
+
+            return (int64_t)value;
+
+        case ENERGY_POWERCAP:
+            len = pread(counter->fd, buffer, sizeof(buffer) - 1, 0);
+
+            if (len <= 0)
+                return -1;
+
+            buffer[len] = '\0';
+
+            return strtoll(buffer, NULL, 10);
+
+        case ENERGY_MSR:
+            if (pread(counter->fd, &value, sizeof(value), counter->config) != sizeof(value))
+                return -1;
+
+            return (int64_t)(value & MSR_ENERGY_MASK);
+
+        default:
+            return -1;
+    }
+}
+
+static int counter_start(enum energy_backend backend, struct energy_counter *counter)
+{
+    int64_t raw = counter_raw(backend, counter);
+
+    if (raw < 0)
+        return -1;
+
+    counter->last_raw = raw;
+    counter->total = raw;
+    counter->uj = (int64_t)(raw * counter->scale_uj);
+
+    return 0;
+}
+
+static int counter_update(enum energy_backend backend, struct energy_counter *counter)
+{
+    int64_t raw = counter_raw(backend, counter);
+
+    if (raw < 0)
+        return -1;
+
+    int64_t diff = raw - counter->last_raw;
+
+    if (diff < 0 && counter->range > 0)
+        diff += counter->range;
+
+    counter->last_raw = raw;
+    counter->total += diff;
+    counter->uj = (int64_t)(counter->total * counter->scale_uj);
+
+    return 0;
+}
+
+static struct energy_counter *add_package(struct energy_source *src, const char *name)
+{
+    if (src->num_packages >= ENERGY_MAX_PACKAGES)
+        return NULL;
+
+    struct energy_counter *counter = &src->packages[src->num_packages];
+
+    counter_reset(counter, src->num_packages++, name);
+
+    return counter;
+}
+
+static struct energy_counter *add_zone(struct energy_source *src, int package, const char *name)
+{
+    if (src->num_zones >= ENERGY_MAX_ZONES)
+        return NULL;
+
+    struct energy_counter *counter = &src->zones[src->num_zones++];
+
+    counter_reset(counter, package, name);
+
+    return counter;
+}
+
+static int open_perf_event(struct energy_counter *counter, int type, int cpu, const char *event)
+{
+    char path[BUFFER_SIZE], buffer[BUFFER_SIZE];
+
+    snprintf(path, sizeof(path), PERF_POWER_PATH "/events/%s", event);
+
+    if (read_line(path, buffer, sizeof(buffer)) != 0 || strncmp(buffer, "event=", 6) != 0)
+        return -1;
+
+    counter->config = strtoull(buffer + 6, NULL, 0);
+
+    snprintf(path, sizeof(path), PERF_POWER_PATH "/events/%s.scale", event);
+
+    if (read_line(path, buffer, sizeof(buffer)) != 0)
+        return -1;
+
+    counter->scale_uj = strtod(buffer, NULL);
+
+    snprintf(path, sizeof(path), PERF_POWER_PATH "/events/%s.unit", event);
+
+    if (read_line(path, buffer, sizeof(buffer)) != 0 || strcmp(buffer, "Joules") != 0)
+        return -1;
+
+    counter->scale_uj *= 1e6;
+
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = counter->config;
+
+    counter->fd = syscall(SYS_perf_event_open, &attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+
+    return counter->fd < 0 ? -1 : 0;
+}
+
+static int open_perf(struct energy_source *src)
+{
+    char buffer[BUFFER_SIZE];
+
+    if (read_line(PERF_POWER_PATH "/type", buffer, sizeof(buffer)) != 0)
+        return -1;
+
+    int type = atoi(buffer);
+
+    // The power PMU is package scoped, cpumask lists one CPU per package
+    if (read_line(PERF_POWER_PATH "/cpumask", buffer, sizeof(buffer)) != 0)
+        strcpy(buffer, "0");
+
+    for (char *cpu = strtok(buffer, ","); cpu; cpu = strtok(NULL, ","))
+    {
+        struct energy_counter *package = add_package(src, "package");
+
+        if (!package || open_perf_event(package, type, atoi(cpu), "energy-pkg") != 0)
+            return -1;
+
+        struct energy_counter *cores = add_zone(src, package->package, "core");
+
+        if (cores && open_perf_event(cores, type, atoi(cpu), "energy-cores") != 0)
+            src->num_zones--;
+    }
+
+    return src->num_packages > 0 ? 0 : -1;
+}
+
+static int open_powercap_zone(struct energy_counter *counter, const char *zone)
+{
+    char path[BUFFER_SIZE], buffer[BUFFER_SIZE];
+
+    snprintf(path, sizeof(path), "%s/name", zone);
+    read_line(path, counter->name, sizeof(counter->name));
+
+    snprintf(path, sizeof(path), "%s/max_energy_range_uj", zone);
+
+    if (read_line(path, buffer, sizeof(buffer)) == 0)
+        counter->range = strtoll(buffer, NULL, 10);
+
+    snprintf(path, sizeof(path), "%s/energy_uj", zone);
+    counter->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    return counter->fd < 0 ? -1 : 0;
+}
+
+static int open_powercap(struct energy_source *src)
+{
+    char zone[ZONE_PATH_SIZE], path[BUFFER_SIZE], name[BUFFER_SIZE];
+
+    for (int i = 0; i < ENERGY_MAX_PACKAGES; i++)
+    {
+        snprintf(zone, sizeof(zone), POWERCAP_PATH "/intel-rapl:%d", i);
+
+        if (access(zone, F_OK) != 0)
+            break;
+
+        // Top-level zones also include psys (platform) and the like, which already contain the packages
+        snprintf(path, sizeof(path), "%s/name", zone);
+
+        if (read_line(path, name, sizeof(name)) != 0 || strncmp(name, "package", 7) != 0)
+            continue;
+
+        struct energy_counter *package = add_package(src, "package");
+
+        if (!package || open_powercap_zone(package, zone) != 0)
+            return -1;
+
+        for (int j = 0; j < ENERGY_MAX_ZONES; j++)
+        {
+            snprintf(zone, sizeof(zone), POWERCAP_PATH "/intel-rapl:%d:%d", i, j);
+
+            if (access(zone, F_OK) != 0)
+                break;
+
+            struct energy_counter *subzone = add_zone(src, package->package, "zone");
+
+            if (subzone && open_powercap_zone(subzone, zone) != 0)
+                src->num_zones--;
+        }
+    }
+
+    return src->num_packages > 0 ? 0 : -1;
+}
+
+static int open_msr(struct energy_source *src)
+{
+    char path[BUFFER_SIZE], buffer[BUFFER_SIZE];
+    int package_ids[ENERGY_MAX_PACKAGES];
+
+    for (int cpu = 0; cpu < MAX_CPUS && src->num_packages < ENERGY_MAX_PACKAGES; cpu++)
+    {
+        int package_id = 0;
+
+        snprintf(path, sizeof(path), CPU_PATH "/cpu%d/topology/physical_package_id", cpu);
+
+        if (read_line(path, buffer, sizeof(buffer)) == 0)
+            package_id = atoi(buffer);
+        else if (cpu > 0)
+            break;
+
+        bool seen = false;
+
+        for (int i = 0; i < src->num_packages; i++)
+            seen |= package_ids[i] == package_id;
+
+        if (seen)
+            continue;
+
+        uint64_t unit;
+
+        snprintf(path, sizeof(path), "/dev/cpu/%d/msr", cpu);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+            return -1;
+
+        package_ids[src->num_packages] = package_id;
+
+        struct energy_counter *package = add_package(src, "package");
+
+        package->fd = fd;
+        package->range = MSR_ENERGY_MASK + 1;
+
+        if (pread(fd, &unit, sizeof(unit), AMD_MSR_RAPL_POWER_UNIT) == sizeof(unit))
+            package->config = AMD_MSR_PKG_ENERGY_STATUS;
+        else if (pread(fd, &unit, sizeof(unit), INTEL_MSR_RAPL_POWER_UNIT) == sizeof(unit))
+            package->config = INTEL_MSR_PKG_ENERGY_STATUS;
+        else
+            return -1;
+
+        // Energy status unit, bits 12:8, counts in 1/2^ESU joules
+        package->scale_uj = 1e6 / (double)(1ULL << ((unit >> 8) & 0x1F));
+
+        if (package->config == INTEL_MSR_PKG_ENERGY_STATUS)
+        {
+            struct energy_counter *cores = add_zone(src, package->package, "core");
+
+            if (cores)
+            {
+                *cores = *package;
+                cores->config = INTEL_MSR_PP0_ENERGY_STATUS;
+                snprintf(cores->name, sizeof(cores->name), "core");
+            }
+        }
+    }
+
+    return src->num_packages > 0 ? 0 : -1;
+}
+
+int energy_open_backend(struct energy_source *src, enum energy_backend backend)
+{
+    int ret = -1;
+
+    memset(src, 0, sizeof(*src));
+    src->backend = backend;
+
+    switch (backend)
+    {
+        case ENERGY_PERF: ret = open_perf(src); break;
+        case ENERGY_POWERCAP: ret = open_powercap(src); break;
+        case ENERGY_MSR: ret = open_msr(src); break;
+        default: break;
+    }
+
+    for (int i = 0; ret == 0 && i < src->num_packages; i++)
+        ret = counter_start(backend, &src->packages[i]);
+
+    for (int i = 0; ret == 0 && i < src->num_zones; i++)
+    {
+        if (counter_start(backend, &src->zones[i]) == 0)
+            continue;
+
+        // An unreadable subzone is dropped, the packages still count
+        if (src->zones[i].fd != src->packages[src->zones[i].package].fd)
+            close(src->zones[i].fd);
+
+        src->zones[i--] = src->zones[--src->num_zones];
+    }
+
+    if (ret != 0)
+    {
+        energy_close(src);
+
+        return -1;
+    }
+
+    return energy_sample(src);
+}
+
+int energy_open(struct energy_source *src)
+{
+    // Cheapest first: a binary perf read, then a sysfs text read, then the root-only MSR
+    static const enum energy_backend order[] = { ENERGY_PERF, ENERGY_POWERCAP, ENERGY_MSR };
+    enum energy_backend cached = discovery_get()->energy_backend;
+
+    // The backend that worked last time, without probing the ones that failed
+    if (cached != ENERGY_NONE && energy_open_backend(src, cached) == 0)
+        return 0;
+
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+    {
+        if (energy_open_backend(src, order[i]) == 0)
+        {
+            discovery_set_energy_backend(order[i]);
+
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "No RAPL energy backend available (perf power PMU, powercap or MSR)!\n");
+
+    return -1;
+}
+
+void energy_close(struct energy_source *src)
+{
+    for (int i = 0; i < src->num_zones; i++)
+        if (src->zones[i].fd >= 0 && (src->backend != ENERGY_MSR || src->zones[i].fd != src->packages[src->zones[i].package].fd))
+            close(src->zones[i].fd);
+
+    for (int i = 0; i < src->num_packages; i++)
+        if (src->packages[i].fd >= 0)
+            close(src->packages[i].fd);
+
+    src->num_packages = 0;
+    src->num_zones = 0;
+    src->backend = ENERGY_NONE;
+}
+
+int energy_sample(struct energy_source *src)
+{
+    struct timespec time;
+    int failed = 0;
+
+    if (src->backend == ENERGY_NONE)
+        return -1;
+
+    src->total_uj = 0;
+
+    for (int i = 0; i < src->num_packages; i++)
+    {
+        if (counter_update(src->backend, &src->packages[i]) != 0)
+            failed++;
+
+        src->total_uj += src->packages[i].uj;
+    }
+
+    for (int i = 0; i < src->num_zones; i++)
+        if (counter_update(src->backend, &src->zones[i]) != 0)
+            failed++;
+
+    // One timestamp for the whole pass, however many sockets were read
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    src->sample_usec = (int64_t)time.tv_sec * USEC + time.tv_nsec / 1000;
+
+    return failed ? -1 : 0;
+}
+
+int64_t energy_read(struct energy_source *src)
+{
+    if (energy_sample(src) != 0)
+        return -1;
+
+    return src->total_uj;
+}
+
+void energy_snapshot(const struct energy_source *src, struct energy_snapshot *snap)
+{
+    snap->usec = src->sample_usec;
+    snap->total_uj = src->total_uj;
+
+    for (int i = 0; i < src->num_packages; i++)
+        snap->packages_uj[i] = src->packages[i].uj;
+}
+
+// Watts between two snapshots for one package, or for all of them with package < 0
+double energy_watts(const struct energy_snapshot *before, const struct energy_snapshot *after, int package)
+{
+    int64_t time_diff_usec = after->usec - before->usec;
+    int64_t energy_diff_uj = package < 0 ? after->total_uj - before->total_uj : after->packages_uj[package] - before->packages_uj[package];
+
+    if (time_diff_usec <= 0 || energy_diff_uj < 0)
+        return -1.0;
+
+    return (double)energy_diff_uj / time_diff_usec;
+}
+
+/*
+ * A one-shot power reading in two halves, so a caller can sample other
+ * counters (cpuidle, PSI) on the same timestamps: energy_window_start()
+ * opens the source on first use and takes the first snapshot,
+ * energy_window_end() sleeps out the rest of window_usec, takes the second
+ * and returns the average package watts between them, or -1.
+ */
+int energy_window_start(struct energy_source *src, struct energy_snapshot *start)
+{
+    if (src->backend == ENERGY_NONE && energy_open(src) != 0)
+        return -1;
+
+    if (energy_sample(src) != 0)
+    {
+        perror("Error reading energy consumption!");
+
+        return -1;
+    }
+
+    energy_snapshot(src, start);
+
+    return 0;
+}
+
+double energy_window_end(struct energy_source *src, const struct energy_snapshot *start, int64_t window_usec, struct energy_snapshot *end)
+{
+    int64_t remaining = start->usec + window_usec - get_monotonicTimeUSec();
+
+    if (remaining > 0)
+        usleep(remaining);
+
+    if (energy_sample(src) != 0)
+    {
+        perror("Error reading energy consumption!");
+
+        return -1.0;
+    }
+
+    energy_snapshot(src, end);
+
+    return energy_watts(start, end, -1);
+}
+
+const char *energy_backend_name(enum energy_backend backend)
+{
+    switch (backend)
+    {
+        case ENERGY_PERF: return "perf";
+        case ENERGY_POWERCAP: return "powercap";
+        case ENERGY_MSR: return "msr";
+        default: return "none";
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ENERGY_MAX_PACKAGES 16
+#define ENERGY_MAX_ZONES 64
+
+enum energy_backend
+{
+    ENERGY_NONE,
+    ENERGY_PERF,
+    ENERGY_POWERCAP,
+    ENERGY_MSR
+};
+
+struct energy_counter
+{
+    int fd;
+    int package;
+    uint64_t config;
+    double scale_uj;
+    int64_t range;
+    int64_t last_raw;
+    int64_t total;
+    int64_t uj;
+    char name[32];
+};
+
+/*
+ * Package energy for every socket, plus the subzones (cores, dram, ...)
+ * each backend exposes, in microjoules. Every counter carries its own wrap
+ * range and wraps are folded into a running total, so values only ever grow
+ * as long as energy_sample() is called at least once per wrap period.
+ * energy_sample() reads all counters in one pass and stamps them with a
+ * single monotonic timestamp.
+ */
+struct energy_source
+{
+    enum energy_backend backend;
+    struct energy_counter packages[ENERGY_MAX_PACKAGES];
+    int num_packages;
+    struct energy_counter zones[ENERGY_MAX_ZONES];
+    int num_zones;
+    int64_t sample_usec;
+    int64_t total_uj;
+};
+
+struct energy_snapshot
+{
+    int64_t usec;
+    int64_t total_uj;
+    int64_t packages_uj[ENERGY_MAX_PACKAGES];
+};
+
+int energy_open(struct energy_source *src);
+int energy_open_backend(struct energy_source *src, enum energy_backend backend);
+void energy_close(struct energy_source *src);
+int energy_sample(struct energy_source *src);
+int64_t energy_read(struct energy_source *src);
+void energy_snapshot(const struct energy_source *src, struct energy_snapshot *snap);
+double energy_watts(const struct energy_snapshot *before, const struct energy_snapshot *after, int package);
+int energy_window_start(struct energy_source *src, struct energy_snapshot *start);
+double energy_window_end(struct energy_source *src, const struct energy_snapshot *start, int64_t window_usec, struct energy_snapshot *end);
+const char *energy_backend_name(enum energy_backend backend);
+
+#endif
@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include "discovery.h"
+#include "energy.h"
+#include "util.h"
+#include "multicall.h"
+
+#define CPU_PATH "/sys/devices/system/cpu"
+#define DEFAULT_PORT 9842
+#define DEFAULT_ADDR "127.0.0.1"
+#define DEFAULT_INTERVAL_MS 1000
+#define MAX_SENSORS 256
+#define MAX_CPUS 256
+#define MAX_CHANNELS 32
+#define BUFFER_SIZE 256
+#define RESPONSE_SIZE (128 * 1024)
+#define REQUEST_SIZE 1024
+#define MAX_CLIENTS 16
+#define CLIENT_TIMEOUT_USEC 2000000
+#define USEC 1000000
+#define LISTEN_BACKLOG 64
+
+enum sensor_kind
+{
+    SENSOR_TEMP,
+    SENSOR_FAN
+};
+
+struct sensor
+{
+    enum sensor_kind kind;
+    int fd;
+    char chip[32];
+    char label[48];
+};
+
+struct snapshot
+{
+    int64_t power_mw;
+    int64_t socket_mw[ENERGY_MAX_PACKAGES];
+    int64_t sensors[MAX_SENSORS];
+    int64_t freqs[MAX_CPUS];
+    bool blacklisted[MAX_PROCESSES];
+};
+
+// A scrape in progress: the request read so far, then whatever of the reply the socket has not taken yet
+struct client
+{
+    int fd;
+    size_t fill;
+    char request[REQUEST_SIZE];
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    int64_t deadline_usec;
+};
+
+struct exporter
+{
+    struct energy_source energy;
+    struct energy_snapshot previous;
+    struct sensor sensors[MAX_SENSORS];
+    int num_sensors;
+    int freq_fds[MAX_CPUS];
+    int num_cpus;
+    char process_list[MAX_PROCESSES][MAX_NAME_LENGTH];
+    int process_count;
+    struct snapshot current;
+    struct snapshot published;
+    char response[RESPONSE_SIZE];
+    size_t response_len;
+    bool has_response;
+    struct client clients[MAX_CLIENTS];
+    int num_clients;
+};
+
+static const char not_found_response[] = "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nNot Found\n";
+static const char overflow_response[] =
+    "HTTP/1.1 500 Internal Server Error\r\nContent-Type: text/plain\r\nContent-Length: 33\r\nConnection: close\r\n\r\nMetrics exceed the response size\n";
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+
+    running = 0;
+}
+
+// Label values may only carry escaped quotes and backslashes, keep it simple and replace them
+static void sanitize_label(char *label)
+{
+    for (; *label; label++)
+        if (*label == '"' || *label == '\\' || !isprint((unsigned char)*label))
+            *label = '_';
+}
+
+static void add_sensor(struct exporter *exp, enum sensor_kind kind, const char *dir, const char *chip, int channel)
+{
+    const char *prefix = kind == SENSOR_TEMP ? "temp" : "fan";
+    char path[BUFFER_SIZE];
+
+    if (exp->num_sensors >= MAX_SENSORS)
+        return;
+
+    struct sensor *sensor = &exp->sensors[exp->num_sensors];
+
+    snprintf(path, sizeof(path), "%s/%s%d_input", dir, prefix, channel);
+    sensor->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (sensor->fd < 0)
+        return;
+
+    snprintf(path, sizeof(path), "%s/%s%d_label", dir, prefix, channel);
+
+    if (read_line(path, sensor->label, sizeof(sensor->label)) != 0)
+        snprintf(sensor->label, sizeof(sensor->label), "%s%d", prefix, channel);
+
+    sensor->kind = kind;
+    snprintf(sensor->chip, sizeof(sensor->chip), "%s", chip);
+    sanitize_label(sensor->label);
+    sanitize_label(sensor->chip);
+    exp->num_sensors++;
+}
+
+static void discover_sensors(struct exporter *exp)
+{
+    const struct discovery *d = discovery_get();
+    char path[DISCOVERY_PATH_LENGTH];
+
+    for (int h = 0; h < d->num_hwmon; h++)
+    {
+        discovery_hwmon_path(&d->hwmon[h], path, sizeof(path));
+
+        for (int i = 1; i <= MAX_CHANNELS; i++)
+        {
+            add_sensor(exp, SENSOR_TEMP, path, d->hwmon[h].name, i);
+            add_sensor(exp, SENSOR_FAN, path, d->hwmon[h].name, i);
+        }
+    }
+}
+
+static void discover_cpus(struct exporter *exp)
+{
+    char path[BUFFER_SIZE];
+
+    exp->num_cpus = 0;
+
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        snprintf(path, sizeof(path), CPU_PATH "/cpu%d/cpufreq/scaling_cur_freq", i);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+            break;
+
+        exp->freq_fds[exp->num_cpus++] = fd;
+    }
+}
+
+// One pass over /proc marks every blacklisted name that is running
+static void scan_processes(struct exporter *exp)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char path[sizeof("/proc//comm") + sizeof(entry->d_name)], pname[MAX_NAME_LENGTH];
+
+    memset(exp->current.blacklisted, 0, sizeof(exp->current.blacklisted));
+
+    if (exp->process_count <= 0 || !(dir = opendir("/proc")))
+        return;
+
+    while ((entry = readdir(dir)))
+    {
+        if (!isdigit((unsigned char)entry->d_name[0]))
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/%s/comm", entry->d_name);
+
+        if (read_line(path, pname, sizeof(pname)) != 0)
+            continue;
+
+        for (int i = 0; i < exp->process_count; i++)
+            if (strcmp(pname, exp->process_list[i]) == 0)
+                exp->current.blacklisted[i] = true;
+    }
+
+    closedir(dir);
+}
+
+static void sample(struct exporter *exp)
+{
+    struct snapshot *snap = &exp->current;
+
+    if (exp->energy.backend != ENERGY_NONE)
+    {
+        struct energy_snapshot current;
+
+        if (energy_sample(&exp->energy) == 0 && exp->energy.sample_usec > exp->previous.usec)
+        {
+            energy_snapshot(&exp->energy, &current);
+            snap->power_mw = (int64_t)(energy_watts(&exp->previous, &current, -1) * 1000);
+
+            for (int i = 0; i < exp->energy.num_packages; i++)
+                snap->socket_mw[i] = (int64_t)(energy_watts(&exp->previous, &current, i) * 1000);
+
+            exp->previous = current;
+        }
+    }
+
+    for (int i = 0; i < exp->num_sensors; i++)
+        snap->sensors[i] = read_int64_fd(exp->sensors[i].fd);
+
+    for (int i = 0; i < exp->num_cpus; i++)
+        snap->freqs[i] = read_int64_fd(exp->freq_fds[i]);
+
+    scan_processes(exp);
+}
+
+static size_t append(char *buffer, size_t len, const char *format, ...)
+{
+    va_list args;
+
+    if (len >= RESPONSE_SIZE)
+        return len;
+
+    va_start(args, format);
+    int written = vsnprintf(buffer + len, RESPONSE_SIZE - len, format, args);
+    va_end(args);
+
+    return written < 0 ? len : len + written;
+}
+
+static size_t format_body(const struct exporter *exp, char *body)
+{
+    const struct snapshot *snap = &exp->current;
+    size_t len = 0;
+    bool any_blacklisted = false;
+
+    if (exp->energy.backend != ENERGY_NONE)
+    {
+        len = append(body, len, "# HELP ryzen_package_power_watts CPU package power from RAPL, summed over sockets.\n");
+        len = append(body, len, "# TYPE ryzen_package_power_watts gauge\n");
+        len = append(body, len, "ryzen_package_power_watts %lld.%03lld\n", (long long)(snap->power_mw / 1000), (long long)(snap->power_mw % 1000));
+        len = append(body, len, "# HELP ryzen_socket_power_watts Power of each RAPL package.\n");
+        len = append(body, len, "# TYPE ryzen_socket_power_watts gauge\n");
+
+        for (int i = 0; i < exp->energy.num_packages; i++)
+            len = append(body, len, "ryzen_socket_power_watts{package=\"%d\"} %lld.%03lld\n", i, (long long)(snap->socket_mw[i] / 1000), (long long)(snap->socket_mw[i] % 1000));
+    }
+
+    len = append(body, len, "# HELP ryzen_temperature_celsius hwmon temperature sensors.\n");
+    len = append(body, len, "# TYPE ryzen_temperature_celsius gauge\n");
+
+    for (int i = 0; i < exp->num_sensors; i++)
+        if (exp->sensors[i].kind == SENSOR_TEMP && snap->sensors[i] >= 0)
+            len = append(body, len, "ryzen_temperature_celsius{chip=\"%s\",sensor=\"%s\"} %lld.%03lld\n", exp->sensors[i].chip, exp->sensors[i].label,
+                         (long long)(snap->sensors[i] / 1000), (long long)(snap->sensors[i] % 1000));
+
+    len = append(body, len, "# HELP ryzen_fan_rpm hwmon fan speeds.\n");
+    len = append(body, len, "# TYPE ryzen_fan_rpm gauge\n");
+
+    for (int i = 0; i < exp->num_sensors; i++)
+        if (exp->sensors[i].kind == SENSOR_FAN && snap->sensors[i] >= 0)
+            len = append(body, len, "ryzen_fan_rpm{chip=\"%s\",sensor=\"%s\"} %lld\n", exp->sensors[i].chip, exp->sensors[i].label, (long long)snap->sensors[i]);
+
+    len = append(body, len, "# HELP ryzen_cpu_frequency_mhz Current cpufreq frequency per CPU.\n");
+    len = append(body, len, "# TYPE ryzen_cpu_frequency_mhz gauge\n");
+
+    for (int i = 0; i < exp->num_cpus; i++)
+        if (snap->freqs[i] >= 0)
+            len = append(body, len, "ryzen_cpu_frequency_mhz{cpu=\"%d\"} %lld\n", i, (long long)(snap->freqs[i] / 1000));
+
+    len = append(body, len, "# HELP ryzen_blacklist_process_running Whether a blacklisted process is running.\n");
+    len = append(body, len, "# TYPE ryzen_blacklist_process_running gauge\n");
+
+    for (int i = 0; i < exp->process_count; i++)
+    {
+        char name[MAX_NAME_LENGTH];
+
+        snprintf(name, sizeof(name), "%s", exp->process_list[i]);
+        sanitize_label(name);
+        len = append(body, len, "ryzen_blacklist_process_running{name=\"%s\"} %d\n", name, snap->blacklisted[i]);
+        any_blacklisted |= snap->blacklisted[i];
+    }
+
+    len = append(body, len, "# HELP ryzen_blacklist_active Whether any blacklisted process is running.\n");
+    len = append(body, len, "# TYPE ryzen_blacklist_active gauge\n");
+    len = append(body, len, "ryzen_blacklist_active %d\n", any_blacklisted);
+
+    // RESPONSE_SIZE or more means the body did not fit
+    return len;
+}
+
+// The full HTTP response is rebuilt only when the snapshot differs from the one already published
+static void publish(struct exporter *exp)
+{
+    static char body[RESPONSE_SIZE];
+
+    if (exp->has_response && memcmp(&exp->current, &exp->published, sizeof(exp->current)) == 0)
+        return;
+
+    char header[BUFFER_SIZE];
+    size_t body_len = format_body(exp, body);
+    int header_len = body_len < RESPONSE_SIZE ? snprintf(header, sizeof(header),
+                                                         "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                                         "Content-Length: %zu\r\nConnection: close\r\n\r\n", body_len) : -1;
+
+    // The header is only written once the body is known to fit, so Content-Length always matches
+    if (header_len < 0 || (size_t)header_len >= sizeof(header) || (size_t)header_len + body_len > RESPONSE_SIZE)
+    {
+        memcpy(exp->response, overflow_response, sizeof(overflow_response) - 1);
+        exp->response_len = sizeof(overflow_response) - 1;
+    }
+    else
+    {
+        memcpy(exp->response, header, header_len);
+        memcpy(exp->response + header_len, body, body_len);
+        exp->response_len = header_len + body_len;
+    }
+
+    exp->published = exp->current;
+    exp->has_response = true;
+}
+
+static void close_client(struct exporter *exp, int index)
+{
+    struct client *client = &exp->clients[index];
+
+    close(client->fd);
+    free(client->out);
+    *client = exp->clients[--exp->num_clients];
+}
+
+static void accept_clients(struct exporter *exp, int listener)
+{
+    int fd;
+
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        if (exp->num_clients == MAX_CLIENTS)
+        {
+            close(fd);
+
+            continue;
+        }
+
+        struct client *client = &exp->clients[exp->num_clients++];
+
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+        client->deadline_usec = get_monotonicTimeUSec() + CLIENT_TIMEOUT_USEC;
+    }
+}
+
+// Sends what the socket takes now; the rest is copied, so a later publish() cannot change a reply mid-flight
+static bool send_reply(struct client *client, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(client->fd, data, len, MSG_NOSIGNAL);
+
+        if (sent > 0)
+        {
+            data += sent;
+            len -= sent;
+        }
+        else if (sent < 0 && errno == EINTR)
+            continue;
+        else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!client->out)
+            {
+                if (!(client->out = malloc(len)))
+                    return true;
+
+                memcpy(client->out, data, len);
+                client->out_len = len;
+            }
+
+            client->out_sent = client->out_len - len;
+
+            return false;
+        }
+        else
+            return true;
+    }
+
+    return true;
+}
+
+// Returns true once the client is done with, either served or gone
+static bool serve_client(struct exporter *exp, struct client *client)
+{
+    if (client->out)
+        return send_reply(client, client->out + client->out_sent, client->out_len - client->out_sent);
+
+    ssize_t len = recv(client->fd, client->request + client->fill, sizeof(client->request) - 1 - client->fill, 0);
+
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return false;
+
+    if (len <= 0)
+        return true;
+
+    client->fill += len;
+    client->request[client->fill] = '\0';
+
+    // Only the request line matters
+    if (!strchr(client->request, '\n') && client->fill < sizeof(client->request) - 1)
+        return false;
+
+    if (strncmp(client->request, "GET /metrics ", 13) == 0 || strncmp(client->request, "GET / ", 6) == 0)
+        return send_reply(client, exp->response, exp->response_len);
+
+    return send_reply(client, not_found_response, sizeof(not_found_response) - 1);
+}
+
+int exporter_main(int argc, char *argv[])
+{
+    static struct exporter exp;
+    const char *addr = DEFAULT_ADDR;
+    const char *blacklist = NULL;
+    int port = DEFAULT_PORT;
+    int interval_ms = DEFAULT_INTERVAL_MS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:i:b:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': addr = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'i': interval_ms = atoi(optarg); break;
+            case 'b': blacklist = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-a ADDR] [-p PORT] [-i INTERVAL_MS] [-b BLACKLIST_CONF]\n", argv[0]);
+
+                return 1;
+        }
+    }
+
+    if (interval_ms <= 0)
+        interval_ms = DEFAULT_INTERVAL_MS;
+
+    if (blacklist && (exp.process_count = load_process_names(blacklist, exp.process_list)) < 0)
+    {
+        perror("Error reading blacklist");
+
+        return 1;
+    }
+
+    if (energy_open(&exp.energy) == 0)
+        energy_snapshot(&exp.energy, &exp.previous);
+
+    discover_sensors(&exp);
+    discover_cpus(&exp);
+
+    int listener = open_listener(addr, port, LISTEN_BACKLOG);
+
+    if (listener < 0)
+        return 1;
+
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec its = { { interval_ms / 1000, (interval_ms % 1000) * 1000000L }, { 0, 1 } };
+
+    if (timer < 0 || timerfd_settime(timer, 0, &its, NULL) != 0)
+    {
+        perror("timerfd");
+
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    sample(&exp);
+    publish(&exp);
+
+    printf("Serving metrics on http://%s:%d/metrics (%d sensors, %d CPUs, energy backend %s)\n",
+           addr, port, exp.num_sensors, exp.num_cpus, energy_backend_name(exp.energy.backend));
+    fflush(stdout);
+
+    struct pollfd fds[2 + MAX_CLIENTS] = { { listener, POLLIN, 0 }, { timer, POLLIN, 0 } };
+
+    // One loop for sampling and scrapes; clients are nonblocking, so a slow scraper cannot delay a sample
+    while (running)
+    {
+        int num_clients = exp.num_clients;
+
+        for (int i = 0; i < num_clients; i++)
+        {
+            fds[2 + i].fd = exp.clients[i].fd;
+            fds[2 + i].events = exp.clients[i].out ? POLLOUT : POLLIN;
+        }
+
+        if (poll(fds, 2 + num_clients, -1) < 0)
+            continue;
+
+        // Back to front, close_client() moves the last client into the freed slot
+        for (int i = num_clients - 1; i >= 0; i--)
+            if (fds[2 + i].revents && serve_client(&exp, &exp.clients[i]))
+                close_client(&exp, i);
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t expirations;
+
+            if (read(timer, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                sample(&exp);
+                publish(&exp);
+            }
+
+            int64_t now = get_monotonicTimeUSec();
+
+            for (int i = exp.num_clients - 1; i >= 0; i--)
+                if (now > exp.clients[i].deadline_usec)
+                    close_client(&exp, i);
+        }
+
+        if (fds[0].revents & POLLIN)
+            accept_clients(&exp, listener);
+    }
+
+    while (exp.num_clients > 0)
+        close_client(&exp, exp.num_clients - 1);
+
+    close(timer);
+    close(listener);
+    energy_close(&exp.energy);
+
+    return 0;
+}
@@ -0,0 +1,954 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "discovery.h"
+#include "energy.h"
+#include "k10temp.h"
+#include "util.h"
+#include "multicall.h"
+
+#define CPU_PATH "/sys/devices/system/cpu"
+#define DEFAULT_PORT 9843
+#define DEFAULT_QUERY_PORT 9844
+#define DEFAULT_QUERY_ADDR "127.0.0.1"
+#define DEFAULT_RATE_MS 1000
+#define BUFFER_SIZE 256
+#define MAX_CPUS 256
+#define MAX_EVENTS 256
+#define MAX_NODES 8192
+#define NODE_SLOTS (MAX_NODES * 2)
+#define HISTORY 60
+#define MAX_TOP 1024
+#define USEC 1000000
+// Thousands of agents may reconnect at once after a collector restart
+#define LISTEN_BACKLOG 4096
+
+#define FLEET_MAGIC 0x31575052
+#define FLEET_VERSION 1
+#define FLEET_HOST_LENGTH 32
+#define FLEET_MAX_CCDS 8
+#define FLEET_MAX_FANS 6
+
+/*
+ * Wire format: one fixed-size little-endian record per sample. Temperatures
+ * are centidegrees, power milliwatts, frequencies MHz. A collector reads
+ * whole records and never has to parse text on the hot path.
+ */
+struct fleet_wire
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t length;
+    uint64_t timestamp_ms;
+    char host[FLEET_HOST_LENGTH];
+    uint32_t power_mw;
+    int16_t tctl_cdeg;
+    int16_t ccd_cdeg[FLEET_MAX_CCDS];
+    uint8_t num_ccds;
+    uint8_t num_fans;
+    uint16_t fan_rpm[FLEET_MAX_FANS];
+    uint16_t freq_min_mhz;
+    uint16_t freq_avg_mhz;
+    uint16_t freq_max_mhz;
+} __attribute__((packed));
+
+struct fleet_sample
+{
+    int64_t received_ms;
+    uint32_t power_mw;
+    int16_t tctl_cdeg;
+    int16_t tccd_max_cdeg;
+    uint16_t freq_avg_mhz;
+};
+
+struct node
+{
+    char host[FLEET_HOST_LENGTH];
+    struct fleet_wire latest;
+    struct fleet_sample history[HISTORY];
+    uint32_t history_count;
+    int64_t received_ms;
+    int connections;
+};
+
+enum connection_kind
+{
+    CONN_NONE,
+    CONN_AGENT_LISTENER,
+    CONN_QUERY_LISTENER,
+    CONN_AGENT,
+    CONN_QUERY
+};
+
+struct connection
+{
+    enum connection_kind kind;
+    int node;
+    size_t fill;
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    char buffer[sizeof(struct fleet_wire) > BUFFER_SIZE ? sizeof(struct fleet_wire) : BUFFER_SIZE];
+};
+
+struct collector
+{
+    struct node *nodes;
+    int num_nodes;
+    int32_t *slots;
+    struct connection *connections;
+    int max_connections;
+    int epoll_fd;
+    uint64_t received;
+};
+
+struct agent_sensors
+{
+    struct energy_source energy;
+    struct energy_snapshot previous;
+    struct k10temp kt;
+    bool has_k10temp;
+    int fan_fds[FLEET_MAX_FANS];
+    int num_fans;
+    int freq_fds[MAX_CPUS];
+    int num_cpus;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+
+    running = 0;
+}
+
+static int64_t get_realtimeMSec()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_REALTIME, &time);
+
+    return (int64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+}
+
+static int connect_to(const char *host, int port)
+{
+    struct addrinfo hints, *result;
+    char service[16];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+
+    if (getaddrinfo(host, service, &hints, &result) != 0)
+        return -1;
+
+    for (struct addrinfo *ai = result; ai && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(result);
+
+    return fd;
+}
+
+static int send_all(int fd, const void *data, size_t len)
+{
+    const char *ptr = data;
+
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, ptr, len, MSG_NOSIGNAL);
+
+        if (sent <= 0)
+        {
+            if (sent < 0 && errno == EINTR)
+                continue;
+
+            return -1;
+        }
+
+        ptr += sent;
+        len -= sent;
+    }
+
+    return 0;
+}
+
+static void agent_open_sensors(struct agent_sensors *sensors)
+{
+    const struct discovery *d = discovery_get();
+    char hwmon_path[BUFFER_SIZE], path[BUFFER_SIZE + 32];
+
+    memset(sensors, 0, sizeof(*sensors));
+
+    if (energy_open(&sensors->energy) == 0)
+        energy_snapshot(&sensors->energy, &sensors->previous);
+
+    sensors->has_k10temp = k10temp_open(&sensors->kt) == 0;
+
+    for (int h = 0; h < d->num_hwmon && sensors->num_fans < FLEET_MAX_FANS; h++)
+    {
+        discovery_hwmon_path(&d->hwmon[h], hwmon_path, sizeof(hwmon_path));
+
+        for (int i = 1; i <= 8 && sensors->num_fans < FLEET_MAX_FANS; i++)
+        {
+            snprintf(path, sizeof(path), "%s/fan%d_input", hwmon_path, i);
+
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+            if (fd >= 0)
+                sensors->fan_fds[sensors->num_fans++] = fd;
+        }
+    }
+
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        snprintf(path, sizeof(path), CPU_PATH "/cpu%d/cpufreq/scaling_cur_freq", i);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+            break;
+
+        sensors->freq_fds[sensors->num_cpus++] = fd;
+    }
+}
+
+static void agent_sample(struct agent_sensors *sensors, struct fleet_wire *wire)
+{
+    struct energy_snapshot current;
+    int64_t freq_min = 0, freq_max = 0, freq_sum = 0;
+
+    memset(wire, 0, sizeof(*wire));
+    wire->magic = htole32(FLEET_MAGIC);
+    wire->version = htole16(FLEET_VERSION);
+    wire->length = htole16(sizeof(*wire));
+    wire->timestamp_ms = htole64(get_realtimeMSec());
+
+    if (sensors->energy.backend != ENERGY_NONE && energy_sample(&sensors->energy) == 0)
+    {
+        energy_snapshot(&sensors->energy, &current);
+
+        double watts = energy_watts(&sensors->previous, &current, -1);
+
+        wire->power_mw = htole32(watts > 0 ? (uint32_t)(watts * 1000) : 0);
+        sensors->previous = current;
+    }
+
+    if (sensors->has_k10temp && k10temp_read(&sensors->kt) == 0)
+    {
+        wire->tctl_cdeg = htole16(sensors->kt.tctl_mc / 10);
+        wire->num_ccds = sensors->kt.num_ccds < FLEET_MAX_CCDS ? sensors->kt.num_ccds : FLEET_MAX_CCDS;
+
+        for (int i = 0; i < wire->num_ccds; i++)
+            wire->ccd_cdeg[i] = htole16(sensors->kt.ccd_mc[i] / 10);
+    }
+
+    wire->num_fans = sensors->num_fans;
+
+    for (int i = 0; i < sensors->num_fans; i++)
+    {
+        int64_t rpm = read_int64_fd(sensors->fan_fds[i]);
+
+        wire->fan_rpm[i] = htole16(rpm > 0 ? (uint16_t)rpm : 0);
+    }
+
+    for (int i = 0; i < sensors->num_cpus; i++)
+    {
+        int64_t khz = read_int64_fd(sensors->freq_fds[i]);
+
+        if (khz < 0)
+            continue;
+
+        if (freq_sum == 0 || khz < freq_min)
+            freq_min = khz;
+
+        if (khz > freq_max)
+            freq_max = khz;
+
+        freq_sum += khz;
+    }
+
+    if (sensors->num_cpus > 0)
+    {
+        wire->freq_min_mhz = htole16(freq_min / 1000);
+        wire->freq_avg_mhz = htole16(freq_sum / sensors->num_cpus / 1000);
+        wire->freq_max_mhz = htole16(freq_max / 1000);
+    }
+}
+
+/*
+ * fleet agent HOST [PORT] [RATE_MS] [COUNT] [NAME]: streams one record per
+ * tick. COUNT > 1 opens that many connections named NAME-0..NAME-N from a
+ * single process, which is how a collector is load tested on one machine.
+ */
+static int agent(int argc, char *argv[])
+{
+    const char *collector_host = argc > 2 ? argv[2] : "127.0.0.1";
+    int port = argc > 3 ? atoi(argv[3]) : DEFAULT_PORT;
+    int rate_ms = argc > 4 ? atoi(argv[4]) : DEFAULT_RATE_MS;
+    int count = argc > 5 ? atoi(argv[5]) : 1;
+    char hostname[FLEET_HOST_LENGTH] = "";
+    struct agent_sensors sensors;
+    struct fleet_wire wire;
+
+    if (rate_ms <= 0 || count <= 0)
+    {
+        fprintf(stderr, "Usage: fleet agent COLLECTOR [PORT] [RATE_MS] [COUNT] [NAME]\n");
+
+        return 1;
+    }
+
+    int *fds = malloc(count * sizeof(int));
+
+    if (!fds)
+        return 1;
+
+    for (int i = 0; i < count; i++)
+        fds[i] = -1;
+
+    if (argc > 6)
+        strncpy(hostname, argv[6], sizeof(hostname) - 1);
+    else
+        gethostname(hostname, sizeof(hostname) - 1);
+
+    agent_open_sensors(&sensors);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    int64_t next = get_monotonicTimeUSec();
+
+    while (running)
+    {
+        agent_sample(&sensors, &wire);
+
+        for (int i = 0; i < count; i++)
+        {
+            if (fds[i] < 0 && (fds[i] = connect_to(collector_host, port)) >= 0)
+            {
+                int one = 1;
+
+                setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+
+            if (fds[i] < 0)
+                continue;
+
+            if (count > 1)
+                snprintf(wire.host, sizeof(wire.host), "%.20s-%d", hostname, i);
+            else
+                memcpy(wire.host, hostname, sizeof(wire.host));
+
+            if (send_all(fds[i], &wire, sizeof(wire)) != 0)
+            {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
+
+        next += rate_ms * 1000LL;
+
+        int64_t delay = next - get_monotonicTimeUSec();
+
+        if (delay > 0)
+            usleep(delay);
+        else
+            next = get_monotonicTimeUSec();
+    }
+
+    for (int i = 0; i < count; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+
+    free(fds);
+
+    return 0;
+}
+
+static uint32_t hash_host(const char *host)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < FLEET_HOST_LENGTH && host[i]; i++)
+        hash = (hash ^ (uint8_t)host[i]) * 16777619u;
+
+    return hash;
+}
+
+// Open addressing over a flat slot array; nodes are never removed, only go stale
+static int find_node(struct collector *col, const char *host, bool create)
+{
+    uint32_t slot = hash_host(host) % NODE_SLOTS;
+
+    while (col->slots[slot] >= 0)
+    {
+        if (strncmp(col->nodes[col->slots[slot]].host, host, FLEET_HOST_LENGTH) == 0)
+            return col->slots[slot];
+
+        slot = (slot + 1) % NODE_SLOTS;
+    }
+
+    if (!create || col->num_nodes >= MAX_NODES)
+        return -1;
+
+    struct node *node = &col->nodes[col->num_nodes];
+
+    memcpy(node->host, host, FLEET_HOST_LENGTH);
+    node->host[FLEET_HOST_LENGTH - 1] = '\0';
+    col->slots[slot] = col->num_nodes;
+
+    return col->num_nodes++;
+}
+
+static int16_t hottest_ccd(const struct fleet_wire *wire)
+{
+    int16_t hottest = INT16_MIN;
+
+    for (int i = 0; i < wire->num_ccds && i < FLEET_MAX_CCDS; i++)
+        if (wire->ccd_cdeg[i] > hottest)
+            hottest = wire->ccd_cdeg[i];
+
+    return hottest == INT16_MIN ? wire->tctl_cdeg : hottest;
+}
+
+/*
+ * Returns false for a record that is not ours: the stream is misaligned or
+ * foreign, and every record after it would be garbage too.
+ */
+static bool store_snapshot(struct collector *col, struct connection *conn)
+{
+    struct fleet_wire wire;
+
+    memcpy(&wire, conn->buffer, sizeof(wire));
+
+    if (le32toh(wire.magic) != FLEET_MAGIC || le16toh(wire.version) != FLEET_VERSION || le16toh(wire.length) != sizeof(wire))
+    {
+        fprintf(stderr, "Dropping agent connection: bad record (magic %08x, version %u, length %u)\n", le32toh(wire.magic), le16toh(wire.version),
+                le16toh(wire.length));
+
+        return false;
+    }
+
+    wire.timestamp_ms = le64toh(wire.timestamp_ms);
+    wire.power_mw = le32toh(wire.power_mw);
+    wire.tctl_cdeg = (int16_t)le16toh(wire.tctl_cdeg);
+
+    for (int i = 0; i < FLEET_MAX_CCDS; i++)
+        wire.ccd_cdeg[i] = (int16_t)le16toh(wire.ccd_cdeg[i]);
+
+    for (int i = 0; i < FLEET_MAX_FANS; i++)
+        wire.fan_rpm[i] = le16toh(wire.fan_rpm[i]);
+
+    wire.freq_min_mhz = le16toh(wire.freq_min_mhz);
+    wire.freq_avg_mhz = le16toh(wire.freq_avg_mhz);
+    wire.freq_max_mhz = le16toh(wire.freq_max_mhz);
+    wire.host[FLEET_HOST_LENGTH - 1] = '\0';
+
+    if (conn->node < 0 || strcmp(col->nodes[conn->node].host, wire.host) != 0)
+    {
+        if (conn->node >= 0)
+            col->nodes[conn->node].connections--;
+
+        if ((conn->node = find_node(col, wire.host, true)) < 0)
+            return true;
+
+        col->nodes[conn->node].connections++;
+    }
+
+    struct node *node = &col->nodes[conn->node];
+    struct fleet_sample *sample = &node->history[node->history_count++ % HISTORY];
+
+    node->latest = wire;
+    node->received_ms = get_realtimeMSec();
+    sample->received_ms = node->received_ms;
+    sample->power_mw = wire.power_mw;
+    sample->tctl_cdeg = wire.tctl_cdeg;
+    sample->tccd_max_cdeg = hottest_ccd(&wire);
+    sample->freq_avg_mhz = wire.freq_avg_mhz;
+    col->received++;
+
+    return true;
+}
+
+enum top_metric
+{
+    TOP_POWER,
+    TOP_TCTL,
+    TOP_TCCD,
+    TOP_FREQ
+};
+
+static int64_t metric_value(const struct node *node, enum top_metric metric)
+{
+    switch (metric)
+    {
+        case TOP_POWER: return node->latest.power_mw;
+        case TOP_TCTL: return node->latest.tctl_cdeg;
+        case TOP_TCCD: return hottest_ccd(&node->latest);
+        default: return node->latest.freq_avg_mhz;
+    }
+}
+
+/*
+ * Top-N keeps a min-heap of the N best nodes seen so far, one pass over the
+ * flat node table: O(nodes * log N) with no allocation beyond the heap.
+ */
+static void heap_sift_down(const struct collector *col, int *heap, int size, int i, enum top_metric metric)
+{
+    while (1)
+    {
+        int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+
+        if (left < size && metric_value(&col->nodes[heap[left]], metric) < metric_value(&col->nodes[heap[smallest]], metric))
+            smallest = left;
+
+        if (right < size && metric_value(&col->nodes[heap[right]], metric) < metric_value(&col->nodes[heap[smallest]], metric))
+            smallest = right;
+
+        if (smallest == i)
+            return;
+
+        int tmp = heap[i];
+
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+static int top_nodes(const struct collector *col, enum top_metric metric, int n, int *heap)
+{
+    int size = 0;
+
+    for (int i = 0; i < col->num_nodes; i++)
+    {
+        if (col->nodes[i].history_count == 0)
+            continue;
+
+        if (size < n)
+        {
+            heap[size++] = i;
+
+            for (int j = size / 2 - 1; size == n && j >= 0; j--)
+                heap_sift_down(col, heap, size, j, metric);
+        }
+        else if (metric_value(&col->nodes[i], metric) > metric_value(&col->nodes[heap[0]], metric))
+        {
+            heap[0] = i;
+            heap_sift_down(col, heap, size, 0, metric);
+        }
+    }
+
+    // Heap sort in place, hottest first
+    for (int j = size / 2 - 1; size < n && j >= 0; j--)
+        heap_sift_down(col, heap, size, j, metric);
+
+    for (int end = size - 1; end > 0; end--)
+    {
+        int tmp = heap[0];
+
+        heap[0] = heap[end];
+        heap[end] = tmp;
+        heap_sift_down(col, heap, end, 0, metric);
+    }
+
+    return size;
+}
+
+static size_t format_node_line(const struct node *node, int64_t now_ms, char *out, size_t size)
+{
+    const struct fleet_wire *w = &node->latest;
+
+    return snprintf(out, size, "%-31s %8.2f W %6.2f C %6.2f C %5u MHz %7lld ms%s\n", node->host, w->power_mw / 1000.0, w->tctl_cdeg / 100.0,
+                    hottest_ccd(w) / 100.0, w->freq_avg_mhz, (long long)(now_ms - node->received_ms), node->connections > 0 ? "" : " offline");
+}
+
+static void close_connection(struct collector *col, int fd)
+{
+    struct connection *conn = &col->connections[fd];
+
+    if (conn->kind == CONN_AGENT && conn->node >= 0)
+        col->nodes[conn->node].connections--;
+
+    epoll_ctl(col->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    free(conn->out);
+    conn->out = NULL;
+    conn->kind = CONN_NONE;
+}
+
+// Keeps what the socket did not take and waits for EPOLLOUT, a slow reader must not stall the loop
+static int queue_reply(struct collector *col, int fd, const char *data, size_t len)
+{
+    struct connection *conn = &col->connections[fd];
+    struct epoll_event ev = { .events = EPOLLOUT, .data.fd = fd };
+
+    if (conn->out)
+    {
+        conn->out_sent = conn->out_len - len;
+
+        return 0;
+    }
+
+    if (!(conn->out = malloc(len)))
+        return -1;
+
+    memcpy(conn->out, data, len);
+    conn->out_len = len;
+    conn->out_sent = 0;
+
+    return epoll_ctl(col->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+// Sends a query reply, or the rest of a queued one, and closes the connection once it is out
+static void send_reply(struct collector *col, int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+
+        if (sent > 0)
+        {
+            data += sent;
+            len -= sent;
+
+            continue;
+        }
+
+        if (sent < 0 && errno == EINTR)
+            continue;
+
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && queue_reply(col, fd, data, len) == 0)
+            return;
+
+        break;
+    }
+
+    close_connection(col, fd);
+}
+
+static void answer_query(struct collector *col, int fd, char *query)
+{
+    static int heap[MAX_TOP];
+    static char response[MAX_TOP * 96 + HISTORY * 64 + BUFFER_SIZE];
+    char command[16] = "", argument[FLEET_HOST_LENGTH] = "";
+    int64_t now_ms = get_realtimeMSec();
+    size_t len = 0;
+    int n = 0;
+
+    sscanf(query, "%15s %31s %d", command, argument, &n);
+
+    if (strcmp(command, "top") == 0)
+    {
+        enum top_metric metric = TOP_TCTL;
+
+        if (strcmp(argument, "power") == 0) metric = TOP_POWER;
+        else if (strcmp(argument, "tccd") == 0) metric = TOP_TCCD;
+        else if (strcmp(argument, "freq") == 0) metric = TOP_FREQ;
+
+        if (n <= 0 || n > MAX_TOP)
+            n = n <= 0 ? 20 : MAX_TOP;
+
+        int count = top_nodes(col, metric, n, heap);
+
+        for (int i = 0; i < count; i++)
+            len += format_node_line(&col->nodes[heap[i]], now_ms, response + len, sizeof(response) - len);
+    }
+    else if (strcmp(command, "node") == 0)
+    {
+        int index = find_node(col, argument, false);
+
+        if (index >= 0)
+        {
+            const struct node *node = &col->nodes[index];
+            uint32_t count = node->history_count < HISTORY ? node->history_count : HISTORY;
+
+            len += format_node_line(node, now_ms, response, sizeof(response));
+
+            for (uint32_t i = 0; i < count; i++)
+            {
+                const struct fleet_sample *s = &node->history[(node->history_count - 1 - i) % HISTORY];
+
+                len += snprintf(response + len, sizeof(response) - len, "  -%6lld ms %8.2f W %6.2f C %6.2f C %5u MHz\n",
+                                (long long)(now_ms - s->received_ms), s->power_mw / 1000.0, s->tctl_cdeg / 100.0, s->tccd_max_cdeg / 100.0, s->freq_avg_mhz);
+            }
+        }
+        else
+            len = snprintf(response, sizeof(response), "unknown node %s\n", argument);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        int online = 0;
+
+        for (int i = 0; i < col->num_nodes; i++)
+            online += col->nodes[i].connections > 0;
+
+        len = snprintf(response, sizeof(response), "nodes %d online %d snapshots %llu\n", col->num_nodes, online, (unsigned long long)col->received);
+    }
+    else
+        len = snprintf(response, sizeof(response), "commands: top power|tctl|tccd|freq [N], node HOST, stats\n");
+
+    if (len >= sizeof(response))
+        len = sizeof(response) - 1;
+
+    send_reply(col, fd, response, len);
+}
+
+static void accept_connections(struct collector *col, int listener, enum connection_kind kind)
+{
+    while (1)
+    {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0)
+            return;
+
+        if (fd >= col->max_connections)
+        {
+            close(fd);
+
+            continue;
+        }
+
+        struct connection *conn = &col->connections[fd];
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+        conn->kind = kind;
+        conn->node = -1;
+        conn->fill = 0;
+
+        if (epoll_ctl(col->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        {
+            close(fd);
+            conn->kind = CONN_NONE;
+        }
+    }
+}
+
+static void read_connection(struct collector *col, int fd)
+{
+    struct connection *conn = &col->connections[fd];
+    size_t record = conn->kind == CONN_AGENT ? sizeof(struct fleet_wire) : sizeof(conn->buffer) - 1;
+
+    while (1)
+    {
+        ssize_t len = recv(fd, conn->buffer + conn->fill, record - conn->fill, 0);
+
+        if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR))
+        {
+            close_connection(col, fd);
+
+            return;
+        }
+
+        if (len < 0)
+            return;
+
+        conn->fill += len;
+
+        if (conn->kind == CONN_QUERY)
+        {
+            conn->buffer[conn->fill] = '\0';
+
+            if (strchr(conn->buffer, '\n') || conn->fill == record)
+            {
+                answer_query(col, fd, conn->buffer);
+
+                return;
+            }
+        }
+        else if (conn->fill == record)
+        {
+            // Closing makes the agent reconnect, and its stream starts aligned again
+            if (!store_snapshot(col, conn))
+            {
+                close_connection(col, fd);
+
+                return;
+            }
+
+            conn->fill = 0;
+        }
+    }
+}
+
+static int collector(int argc, char *argv[])
+{
+    static struct collector col;
+    struct epoll_event events[MAX_EVENTS];
+    struct rlimit limit;
+    const char *query_addr = DEFAULT_QUERY_ADDR;
+
+    // The query port is unauthenticated, so it stays on loopback unless -a says otherwise
+    if (argc > 3 && strcmp(argv[2], "-a") == 0)
+    {
+        query_addr = argv[3];
+        argc -= 2;
+        argv += 2;
+    }
+
+    int port = argc > 2 ? atoi(argv[2]) : DEFAULT_PORT;
+    int query_port = argc > 3 ? atoi(argv[3]) : DEFAULT_QUERY_PORT;
+
+    // Thousands of agents need thousands of fds
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    col.max_connections = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 1048576 ? (int)limit.rlim_cur : 1048576;
+    col.nodes = calloc(MAX_NODES, sizeof(struct node));
+    col.slots = malloc(NODE_SLOTS * sizeof(int32_t));
+    col.connections = calloc(col.max_connections, sizeof(struct connection));
+
+    if (!col.nodes || !col.slots || !col.connections)
+    {
+        fprintf(stderr, "Failed to allocate the node table!\n");
+
+        return 1;
+    }
+
+    memset(col.slots, 0xff, NODE_SLOTS * sizeof(int32_t));
+
+    int agent_listener = open_listener("0.0.0.0", port, LISTEN_BACKLOG);
+    int query_listener = open_listener(query_addr, query_port, LISTEN_BACKLOG);
+
+    col.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (agent_listener < 0 || query_listener < 0 || col.epoll_fd < 0)
+        return 1;
+
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    ev.data.fd = agent_listener;
+    epoll_ctl(col.epoll_fd, EPOLL_CTL_ADD, agent_listener, &ev);
+    col.connections[agent_listener].kind = CONN_AGENT_LISTENER;
+    ev.data.fd = query_listener;
+    epoll_ctl(col.epoll_fd, EPOLL_CTL_ADD, query_listener, &ev);
+    col.connections[query_listener].kind = CONN_QUERY_LISTENER;
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Collecting on port %d, queries on %s:%d\n", port, query_addr, query_port);
+    fflush(stdout);
+
+    while (running)
+    {
+        int count = epoll_wait(col.epoll_fd, events, MAX_EVENTS, -1);
+
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+
+            switch (col.connections[fd].kind)
+            {
+                case CONN_AGENT_LISTENER: accept_connections(&col, fd, CONN_AGENT); break;
+                case CONN_QUERY_LISTENER: accept_connections(&col, fd, CONN_QUERY); break;
+                case CONN_QUERY:
+                    if (col.connections[fd].out)
+                    {
+                        struct connection *conn = &col.connections[fd];
+
+                        send_reply(&col, fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
+
+                        break;
+                    }
+                    // fall through
+                case CONN_AGENT: read_connection(&col, fd); break;
+                default: break;
+            }
+        }
+    }
+
+    close(agent_listener);
+    close(query_listener);
+    close(col.epoll_fd);
+
+    return 0;
+}
+
+static int query(int argc, char *argv[])
+{
+    const char *host = argc > 2 ? argv[2] : "127.0.0.1";
+    int port = argc > 3 ? atoi(argv[3]) : DEFAULT_QUERY_PORT;
+    char request[BUFFER_SIZE] = "";
+    char buffer[4096];
+    size_t len = 0;
+
+    for (int i = 4; i < argc && len < sizeof(request) - 2; i++)
+        len += snprintf(request + len, sizeof(request) - len, "%s%s", i > 4 ? " " : "", argv[i]);
+
+    if (len >= sizeof(request) - 1)
+        len = sizeof(request) - 2;
+
+    request[len++] = '\n';
+
+    int fd = connect_to(host, port);
+
+    if (fd < 0 || send_all(fd, request, len) != 0)
+    {
+        perror("Error contacting collector");
+
+        return 1;
+    }
+
+    ssize_t received;
+
+    while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        fwrite(buffer, 1, received, stdout);
+
+    close(fd);
+
+    return 0;
+}
+
+int fleet_main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "agent") == 0)
+        return agent(argc, argv);
+
+    if (argc > 1 && strcmp(argv[1], "collector") == 0)
+        return collector(argc, argv);
+
+    if (argc > 1 && strcmp(argv[1], "query") == 0)
+        return query(argc, argv);
+
+    fprintf(stderr, "Usage: %s agent COLLECTOR [PORT] [RATE_MS] [COUNT] [NAME]\n", argv[0]);
+    fprintf(stderr, "       %s collector [-a QUERY_ADDR] [PORT] [QUERY_PORT]\n", argv[0]);
+    fprintf(stderr, "       %s query COLLECTOR [QUERY_PORT] top power|tctl|tccd|freq [N] | node HOST | stats\n", argv[0]);
+
+    return 1;
+}
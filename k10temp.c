@@ -0,0 +1,171 @@
+#include "k10temp.h"
+#include "discovery.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define K10TEMP_MAX_CHANNEL 14
+#define BUFFER_SIZE 512
+
+static int read_millidegrees(int fd)
+{
+    char buffer[16];
+    ssize_t len = pread(fd, buffer, sizeof(buffer) - 1, 0);
+
+    if (len <= 0)
+        return -1;
+
+    buffer[len] = '\0';
+
+    return atoi(buffer);
+}
+
+static int open_channel(struct k10temp *kt, const char *hwmon_path, int channel, int ccd_id)
+{
+    char path[BUFFER_SIZE];
+
+    snprintf(path, sizeof(path), "%s/temp%d_input", hwmon_path, channel);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    if (ccd_id < 0)
+        kt->tctl_fd = fd;
+    else
+    {
+        kt->ccd_fds[kt->num_ccds] = fd;
+        kt->ccd_ids[kt->num_ccds] = ccd_id;
+        kt->ccd_mc[kt->num_ccds] = -1;
+        kt->num_ccds++;
+    }
+
+    return 0;
+}
+
+// The channel map from the discovery cache: only the fds we keep are opened
+static int open_cached(struct k10temp *kt, const struct discovery *d)
+{
+    char hwmon_path[DISCOVERY_PATH_LENGTH];
+
+    if (d->k10temp_hwmon < 0)
+        return -1;
+
+    discovery_hwmon_path(&d->hwmon[d->k10temp_hwmon], hwmon_path, sizeof(hwmon_path));
+
+    if (d->k10temp_tctl_channel > 0 && open_channel(kt, hwmon_path, d->k10temp_tctl_channel, -1) != 0)
+        return -1;
+
+    for (int i = 0; i < d->k10temp_num_ccds && i < K10TEMP_MAX_CCDS; i++)
+        if (open_channel(kt, hwmon_path, d->k10temp_ccd_channels[i], d->k10temp_ccd_ids[i]) != 0)
+            return -1;
+
+    return kt->tctl_fd >= 0 || kt->num_ccds > 0 ? 0 : -1;
+}
+
+// Resolves every channel by label and records the result in the discovery cache
+static int scan_channels(struct k10temp *kt)
+{
+    const struct discovery_hwmon *hwmon = discovery_find_hwmon("k10temp", 0);
+    char hwmon_path[DISCOVERY_PATH_LENGTH], path[BUFFER_SIZE], label[32];
+    int tctl_channel = 0, ccd_channels[K10TEMP_MAX_CCDS];
+
+    if (!hwmon)
+    {
+        discovery_set_k10temp(-1, 0, NULL, NULL, 0);
+
+        return -1;
+    }
+
+    discovery_hwmon_path(hwmon, hwmon_path, sizeof(hwmon_path));
+
+    for (int i = 1; i <= K10TEMP_MAX_CHANNEL; i++)
+    {
+        snprintf(path, sizeof(path), "%s/temp%d_label", hwmon_path, i);
+
+        if (read_line(path, label, sizeof(label)) != 0)
+        {
+            // Older kernels have no labels, temp1 is still Tctl
+            if (i != 1)
+                continue;
+
+            strcpy(label, "Tctl");
+        }
+
+        if (strcmp(label, "Tctl") == 0 && open_channel(kt, hwmon_path, i, -1) == 0)
+            tctl_channel = i;
+        else if (strncmp(label, "Tccd", 4) == 0 && kt->num_ccds < K10TEMP_MAX_CCDS && open_channel(kt, hwmon_path, i, atoi(label + 4)) == 0)
+            ccd_channels[kt->num_ccds - 1] = i;
+    }
+
+    discovery_set_k10temp(hwmon - discovery_get()->hwmon, tctl_channel, ccd_channels, kt->ccd_ids, kt->num_ccds);
+
+    return kt->tctl_fd >= 0 || kt->num_ccds > 0 ? 0 : -1;
+}
+
+static void reset(struct k10temp *kt)
+{
+    memset(kt, 0, sizeof(*kt));
+    kt->tctl_fd = -1;
+    kt->tctl_mc = -1;
+    kt->hottest = -1;
+}
+
+int k10temp_open(struct k10temp *kt)
+{
+    const struct discovery *d = discovery_get();
+
+    reset(kt);
+
+    if (d->k10temp_known)
+    {
+        if (open_cached(kt, d) == 0 || d->k10temp_hwmon < 0)
+            return kt->tctl_fd >= 0 || kt->num_ccds > 0 ? 0 : -1;
+
+        // A cached channel is gone (driver reloaded, hwmon renumbered): walk sysfs again
+        k10temp_close(kt);
+        reset(kt);
+        discovery_invalidate();
+    }
+
+    return scan_channels(kt);
+}
+
+void k10temp_close(struct k10temp *kt)
+{
+    if (kt->tctl_fd >= 0)
+        close(kt->tctl_fd);
+
+    for (int i = 0; i < kt->num_ccds; i++)
+        close(kt->ccd_fds[i]);
+
+    kt->tctl_fd = -1;
+    kt->num_ccds = 0;
+}
+
+int k10temp_read(struct k10temp *kt)
+{
+    int failed = 0;
+
+    kt->hottest = -1;
+
+    if (kt->tctl_fd >= 0 && (kt->tctl_mc = read_millidegrees(kt->tctl_fd)) < 0)
+        failed++;
+
+    for (int i = 0; i < kt->num_ccds; i++)
+    {
+        kt->ccd_mc[i] = read_millidegrees(kt->ccd_fds[i]);
+
+        if (kt->ccd_mc[i] < 0)
+            failed++;
+        else if (kt->hottest < 0 || kt->ccd_mc[i] > kt->ccd_mc[kt->hottest])
+            kt->hottest = i;
+    }
+
+    return failed ? -1 : 0;
+}
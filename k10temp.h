@@ -0,0 +1,26 @@
+#ifndef K10TEMP_H
+#define K10TEMP_H
+
+#define K10TEMP_MAX_CCDS 12
+
+/*
+ * k10temp channels resolved once by label: temp1 is Tctl and temp3..temp14
+ * are Tccd1..Tccd12, only present for the CCDs the part actually has.
+ * k10temp_read() refreshes every channel in one pass over the open fds.
+ */
+struct k10temp
+{
+    int tctl_fd;
+    int tctl_mc;
+    int ccd_fds[K10TEMP_MAX_CCDS];
+    int ccd_ids[K10TEMP_MAX_CCDS];
+    int ccd_mc[K10TEMP_MAX_CCDS];
+    int num_ccds;
+    int hottest;
+};
+
+int k10temp_open(struct k10temp *kt);
+void k10temp_close(struct k10temp *kt);
+int k10temp_read(struct k10temp *kt);
+
+#endif
@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "discovery.h"
+#include "util.h"
+#include "multicall.h"
+
+#define PROGRAM_NAME "ryzen-power"
+#define DEFAULT_BENCH_RUNS 5
+#define MAX_BENCH_RUNS 100
+#define BENCH_TIMEOUT_MS 5000
+#define BENCH_CACHE_DIR "/tmp/ryzen-power-bench.XXXXXX"
+#define BUFFER_SIZE 256
+#define USEC 1000000
+
+struct applet
+{
+    const char *name;
+    int (*main)(int argc, char *argv[]);
+};
+
+static const struct applet applets[] =
+{
+    { "ryzen", ryzen_main },
+    { "cpuf", cpuf_main },
+    { "sens", sens_main },
+    { "powerusage", powerusage_main },
+    { "powerlimit", powerlimit_main },
+    { "exporter", exporter_main },
+    { "fleet", fleet_main },
+};
+
+#define NUM_APPLETS (int)(sizeof(applets) / sizeof(applets[0]))
+
+// Every mode that prints on its own, as it would be typed on the command line
+static const char *const bench_modes[][6] =
+{
+    { "ryzen", NULL },
+    { "ryzen", "-w", "100", NULL },
+    { "ryzen", "throttle", "-i", "100", NULL },
+    { "cpuf", NULL },
+    { "sens", NULL },
+    { "powerusage", "/dev/null", "cpu", NULL },
+    { "powerusage", "/dev/null", "cpu", "100", NULL },
+    { "powerusage", "/dev/null", "gpu", NULL },
+};
+
+#define NUM_BENCH_MODES (int)(sizeof(bench_modes) / sizeof(bench_modes[0]))
+
+static const struct applet *find_applet(const char *name)
+{
+    const char *base = strrchr(name, '/');
+
+    base = base ? base + 1 : name;
+
+    for (int i = 0; i < NUM_APPLETS; i++)
+        if (strcmp(applets[i].name, base) == 0)
+            return &applets[i];
+
+    return NULL;
+}
+
+/*
+ * Runs one mode as a fresh process, dispatched through argv[0] like a
+ * symlink would, and returns the microseconds from fork() to its first byte
+ * of output (stdout or stderr), or to its exit if it printed nothing.
+ */
+static int64_t time_to_first_output(const char *const mode[], char *first_line, size_t size, bool *printed)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+        return -1;
+
+    int64_t start = get_monotonicTimeUSec();
+    pid_t pid = fork();
+
+    if (pid < 0)
+        return -1;
+
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv("/proc/self/exe", (char *const *)mode);
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    int64_t elapsed = -1;
+    ssize_t len = 0;
+
+    *printed = false;
+    first_line[0] = '\0';
+
+    if (poll(&pfd, 1, BENCH_TIMEOUT_MS) > 0)
+    {
+        elapsed = get_monotonicTimeUSec() - start;
+
+        // Leading blank lines (cpuf) are output too, but show the first real line
+        len = read(fds[0], first_line, size - 1);
+        *printed = len > 0;
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(fds[0]);
+
+    if (len > 0)
+    {
+        char *line = first_line;
+
+        first_line[len] = '\0';
+
+        while (*line == '\n')
+            line++;
+
+        line[strcspn(line, "\n")] = '\0';
+        memmove(first_line, line, strlen(line) + 1);
+    }
+
+    return elapsed;
+}
+
+// Runs that never printed within BENCH_TIMEOUT_MS show as "timeout"
+static const char *format_ms(int64_t usec, char *buffer, size_t size)
+{
+    if (usec < 0)
+        return "timeout";
+
+    snprintf(buffer, size, "%.3f", usec / 1000.0);
+
+    return buffer;
+}
+
+// Timeouts (-1) sort last, so min stays a real run when any finished
+static int compare_int64(const void *a, const void *b)
+{
+    uint64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * The first run of every mode starts without a discovery cache, the rest
+ * reuse the one it wrote. The benchmark gets its own cache in a private
+ * mkdtemp() directory, the user's is left alone.
+ */
+static int bench_startup(int runs)
+{
+    char cache_dir[] = BENCH_CACHE_DIR, cache[BUFFER_SIZE], command[BUFFER_SIZE], first_line[BUFFER_SIZE];
+    char cold_ms[32], min_ms[32], median_ms[32];
+    int64_t warm[MAX_BENCH_RUNS];
+
+    if (!mkdtemp(cache_dir))
+    {
+        perror("mkdtemp");
+
+        return 1;
+    }
+
+    snprintf(cache, sizeof(cache), "%s/discovery", cache_dir);
+    setenv("RYZEN_POWER_CACHE", cache, 1);
+
+    printf("%-36s %10s %10s %10s  %s\n", "mode", "cold (ms)", "min (ms)", "median (ms)", "first output");
+
+    for (int m = 0; m < NUM_BENCH_MODES; m++)
+    {
+        bool printed;
+        size_t len = 0;
+
+        command[0] = '\0';
+
+        for (int i = 0; bench_modes[m][i] && len < sizeof(command); i++)
+            len += snprintf(command + len, sizeof(command) - len, "%s%s", i ? " " : "", bench_modes[m][i]);
+
+        unlink(cache);
+
+        int64_t cold = time_to_first_output(bench_modes[m], first_line, sizeof(first_line), &printed);
+
+        for (int r = 0; r < runs; r++)
+            warm[r] = time_to_first_output(bench_modes[m], first_line, sizeof(first_line), &printed);
+
+        qsort(warm, runs, sizeof(warm[0]), compare_int64);
+
+        printf("%-36s %10s %10s %10s  %.40s\n", command, format_ms(cold, cold_ms, sizeof(cold_ms)),
+               format_ms(warm[0], min_ms, sizeof(min_ms)), format_ms(warm[runs / 2], median_ms, sizeof(median_ms)),
+               printed ? first_line : "(no output)");
+        fflush(stdout);
+    }
+
+    unlink(cache);
+    rmdir(cache_dir);
+
+    return 0;
+}
+
+static int usage()
+{
+    fprintf(stderr, "Usage: " PROGRAM_NAME " APPLET [ARGS...]  (or call it through a symlink named after the applet)\n");
+    fprintf(stderr, "       " PROGRAM_NAME " --bench-startup [RUNS]\n");
+    fprintf(stderr, "       " PROGRAM_NAME " --rescan\n");
+    fprintf(stderr, "Applets:");
+
+    for (int i = 0; i < NUM_APPLETS; i++)
+        fprintf(stderr, " %s", applets[i].name);
+
+    fprintf(stderr, "\n");
+
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct applet *applet = find_applet(argv[0]);
+
+    // ryzen-power APPLET ARGS... behaves exactly like the APPLET symlink
+    if (!applet && argc > 1 && (applet = find_applet(argv[1])))
+    {
+        argc--;
+        argv++;
+    }
+
+    if (applet)
+    {
+        // Shared init: every applet starts from the same discovery cache
+        discovery_get();
+
+        return applet->main(argc, argv);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--bench-startup") == 0)
+    {
+        int runs = argc > 2 ? atoi(argv[2]) : DEFAULT_BENCH_RUNS;
+
+        return bench_startup(runs > 0 && runs <= MAX_BENCH_RUNS ? runs : DEFAULT_BENCH_RUNS);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "--rescan") == 0)
+    {
+        discovery_invalidate();
+        printf("Discovered %d hwmon chip(s), %d CPU(s)\n", discovery_get()->num_hwmon, discovery_get()->num_cpus);
+
+        return 0;
+    }
+
+    return usage();
+}
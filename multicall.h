@@ -0,0 +1,13 @@
+#ifndef MULTICALL_H
+#define MULTICALL_H
+
+// Entry points of the tools linked into the ryzen-power multicall binary
+int ryzen_main(int argc, char *argv[]);
+int cpuf_main(int argc, char *argv[]);
+int sens_main(int argc, char *argv[]);
+int powerusage_main(int argc, char *argv[]);
+int powerlimit_main(int argc, char *argv[]);
+int exporter_main(int argc, char *argv[]);
+int fleet_main(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "discovery.h"
+#include "energy.h"
+#include "util.h"
+#include "multicall.h"
+
+#define CPU_PATH "/sys/devices/system/cpu"
+#define MAX_CPUS 256
+#define MAX_CCDS 16
+#define BUFFER_SIZE 256
+#define USEC 1000000
+
+#define DEFAULT_INTERVAL_MS 250
+#define DEFAULT_KP 0.004
+#define DEFAULT_KI 0.020
+#define DEFAULT_HYSTERESIS_W 1.0
+#define SETTLE_BAND 0.03
+#define SETTLE_SAMPLES 8
+#define MIN_STEP_KHZ 25000
+
+#define SIM_IDLE_W 22.0
+#define SIM_FULL_W 118.0
+#define SIM_TAU_SEC 0.15
+#define SIM_CORES 16
+#define SIM_CCDS 2
+#define SIM_MIN_KHZ 545000
+#define SIM_MAX_KHZ 5050000
+
+struct cpu_core
+{
+    int id;
+    int ccd;
+    int max_fd;
+    int64_t min_khz;
+    int64_t max_khz;
+    int64_t original_khz;
+    int64_t written_khz;
+};
+
+struct limiter
+{
+    double target_w;
+    double kp;
+    double ki;
+    double hysteresis_w;
+    double integral;
+    double output;
+    double output_max;
+    int interval_ms;
+    bool per_ccd;
+    bool simulate;
+    bool verbose;
+    double duration_sec;
+    const char *sysfs_root;
+    struct cpu_core cores[MAX_CPUS];
+    int num_cores;
+    int num_ccds;
+};
+
+/*
+ * Settled means: entered the band and stayed there until the end of the
+ * run. entry_sec is when the current in-band stretch began, -1 while out of
+ * band, so the result only becomes final once the run is over.
+ */
+struct settle_tracker
+{
+    double start_sec;
+    double entry_sec;
+    double overshoot_w;
+    bool crossed;
+    int in_band;
+};
+
+struct sim_plant
+{
+    double power_w;
+    uint32_t noise;
+};
+
+struct rapl_reader
+{
+    struct energy_source energy;
+    int64_t last_uj;
+    int64_t last_usec;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+
+    running = 0;
+}
+
+static int write_khz(struct cpu_core *core, int64_t khz)
+{
+    char buffer[32];
+    int len = snprintf(buffer, sizeof(buffer), "%lld\n", (long long)khz);
+
+    if (core->max_fd < 0 || pwrite(core->max_fd, buffer, len, 0) != len)
+        return -1;
+
+    core->written_khz = khz;
+
+    return 0;
+}
+
+// CCDs are identified by the L3 they share: cached by discovery for the live tree, read from a -r fixture directly
+static int core_l3_id(const struct limiter *lim, int cpu)
+{
+    const struct discovery *d = discovery_get();
+    char path[BUFFER_SIZE];
+
+    if (!*lim->sysfs_root)
+        return cpu < d->num_cpus ? d->l3_ids[cpu] : 0;
+
+    snprintf(path, sizeof(path), "%s%s/cpu%d/cache/index3/id", lim->sysfs_root, CPU_PATH, cpu);
+
+    int64_t l3_id = read_int64_path(path);
+
+    return l3_id >= 0 ? (int)l3_id : 0;
+}
+
+static int discover_cores(struct limiter *lim)
+{
+    char path[BUFFER_SIZE];
+    int ccd_ids[MAX_CCDS];
+
+    lim->num_cores = 0;
+    lim->num_ccds = 0;
+
+    for (int i = 0; i < MAX_CPUS; i++)
+    {
+        struct cpu_core *core = &lim->cores[lim->num_cores];
+
+        snprintf(path, sizeof(path), "%s%s/cpu%d/cpufreq/cpuinfo_max_freq", lim->sysfs_root, CPU_PATH, i);
+        core->max_khz = read_int64_path(path);
+
+        if (core->max_khz <= 0)
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s/cpu%d/cpufreq/cpuinfo_min_freq", lim->sysfs_root, CPU_PATH, i);
+        core->min_khz = read_int64_path(path);
+
+        if (core->min_khz <= 0 || core->min_khz > core->max_khz)
+            core->min_khz = core->max_khz / 4;
+
+        // A simulation only borrows the live topology, it never touches the live caps
+        if (lim->simulate && !*lim->sysfs_root)
+        {
+            core->max_fd = -1;
+            core->original_khz = -1;
+            core->written_khz = core->max_khz;
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "%s%s/cpu%d/cpufreq/scaling_max_freq", lim->sysfs_root, CPU_PATH, i);
+            core->original_khz = read_int64_path(path);
+            core->max_fd = open(path, O_RDWR);
+            core->written_khz = core->original_khz;
+
+            if (core->max_fd < 0 && !lim->simulate)
+            {
+                perror("Error opening scaling_max_freq");
+
+                return -1;
+            }
+        }
+
+        int l3_id = core_l3_id(lim, i);
+        int ccd = 0;
+
+        while (ccd < lim->num_ccds && ccd_ids[ccd] != l3_id)
+            ccd++;
+
+        if (ccd == lim->num_ccds && lim->num_ccds < MAX_CCDS)
+            ccd_ids[lim->num_ccds++] = l3_id;
+
+        core->id = i;
+        core->ccd = ccd < MAX_CCDS ? ccd : MAX_CCDS - 1;
+        lim->num_cores++;
+    }
+
+    if (lim->num_cores == 0 && lim->simulate)
+    {
+        for (int i = 0; i < SIM_CORES; i++)
+        {
+            struct cpu_core *core = &lim->cores[i];
+
+            core->id = i;
+            core->ccd = i * SIM_CCDS / SIM_CORES;
+            core->max_fd = -1;
+            core->min_khz = SIM_MIN_KHZ;
+            core->max_khz = SIM_MAX_KHZ;
+            core->original_khz = -1;
+            core->written_khz = SIM_MAX_KHZ;
+        }
+
+        lim->num_cores = SIM_CORES;
+        lim->num_ccds = SIM_CCDS;
+    }
+
+    return lim->num_cores > 0 ? 0 : -1;
+}
+
+static void restore_cores(struct limiter *lim)
+{
+    for (int i = 0; i < lim->num_cores; i++)
+    {
+        struct cpu_core *core = &lim->cores[i];
+
+        if (core->original_khz > 0)
+            write_khz(core, core->original_khz);
+
+        if (core->max_fd >= 0)
+            close(core->max_fd);
+    }
+}
+
+/*
+ * The controller output runs from 0 (every core at cpuinfo_min_freq) to
+ * output_max (every core unrestricted). In package mode output_max is 1 and
+ * all cores share the cap. In CCD mode output_max is the CCD count and the
+ * last CCD is throttled first, so CCD 0 keeps its clocks for as long as the
+ * budget allows.
+ */
+static double ccd_level(const struct limiter *lim, int ccd)
+{
+    double level = lim->per_ccd ? lim->output - ccd : lim->output;
+
+    if (level < 0.0)
+        return 0.0;
+
+    return level > 1.0 ? 1.0 : level;
+}
+
+static int apply_output(struct limiter *lim)
+{
+    int changed = 0;
+
+    for (int i = 0; i < lim->num_cores; i++)
+    {
+        struct cpu_core *core = &lim->cores[i];
+        double level = ccd_level(lim, core->ccd);
+        int64_t khz = core->min_khz + (int64_t)(level * (core->max_khz - core->min_khz));
+
+        if (llabs(khz - core->written_khz) < MIN_STEP_KHZ && khz != core->max_khz && khz != core->min_khz)
+            continue;
+
+        if (khz == core->written_khz)
+            continue;
+
+        if (write_khz(core, khz) == 0)
+            changed++;
+        else if (!lim->simulate)
+            perror("Error writing scaling_max_freq");
+        else
+            core->written_khz = khz;
+    }
+
+    return changed;
+}
+
+static void controller_step(struct limiter *lim, double power_w, double dt)
+{
+    double error = lim->target_w - power_w;
+
+    // Inside the hysteresis band the cap is left alone
+    if (error > -lim->hysteresis_w && error < lim->hysteresis_w)
+        return;
+
+    double integral = lim->integral + error * dt;
+    double output = lim->kp * error + lim->ki * integral;
+
+    // Conditional integration: stop accumulating while saturated in the direction of the error
+    if (output > lim->output_max)
+    {
+        output = lim->output_max;
+
+        if (error < 0)
+            lim->integral = integral;
+    }
+    else if (output < 0.0)
+    {
+        output = 0.0;
+
+        if (error > 0)
+            lim->integral = integral;
+    }
+    else
+        lim->integral = integral;
+
+    lim->output = output;
+}
+
+static void settle_update(struct settle_tracker *st, double now_sec, double power_w, double target_w, double hysteresis_w)
+{
+    double band = target_w * SETTLE_BAND;
+
+    // The controller ignores errors inside its hysteresis, on top of RAPL noise
+    if (band < 2.0 * hysteresis_w)
+        band = 2.0 * hysteresis_w;
+
+    if (band < 1.0)
+        band = 1.0;
+
+    if (!st->crossed && power_w <= target_w)
+        st->crossed = true;
+
+    if (st->crossed && power_w - target_w > st->overshoot_w)
+        st->overshoot_w = power_w - target_w;
+
+    if (power_w > target_w - band && power_w < target_w + band)
+    {
+        if (st->in_band++ == 0)
+            st->entry_sec = now_sec;
+    }
+    else
+    {
+        st->in_band = 0;
+        st->entry_sec = -1;
+    }
+}
+
+// Time from start to the last entry into the band, -1 if the run ended outside it or too soon after
+static double settle_time(const struct settle_tracker *st)
+{
+    if (st->entry_sec < 0 || st->in_band < SETTLE_SAMPLES)
+        return -1;
+
+    return st->entry_sec - st->start_sec;
+}
+
+static double sim_power(struct limiter *lim, struct sim_plant *plant, double dt)
+{
+    double load = 0.0;
+
+    for (int i = 0; i < lim->num_cores; i++)
+    {
+        const struct cpu_core *core = &lim->cores[i];
+        double ratio = (double)core->written_khz / core->max_khz;
+
+        // Dynamic power grows roughly with f * V^2, which tracks f^2.5 on these parts
+        load += ratio * ratio * sqrt(ratio);
+    }
+
+    double steady = SIM_IDLE_W + (SIM_FULL_W - SIM_IDLE_W) * load / lim->num_cores;
+
+    plant->power_w += (steady - plant->power_w) * (dt / (SIM_TAU_SEC + dt));
+    plant->noise = plant->noise * 1664525u + 1013904223u;
+
+    return plant->power_w + ((int)((plant->noise >> 16) % 200) - 100) / 100.0;
+}
+
+static int rapl_open(struct rapl_reader *rapl)
+{
+    if (energy_open(&rapl->energy) != 0)
+        return -1;
+
+    rapl->last_uj = energy_read(&rapl->energy);
+    rapl->last_usec = get_monotonicTimeUSec();
+
+    return rapl->last_uj < 0 ? -1 : 0;
+}
+
+static double rapl_watts(struct rapl_reader *rapl)
+{
+    int64_t energy = energy_read(&rapl->energy);
+    int64_t now = get_monotonicTimeUSec();
+
+    if (energy < 0 || now <= rapl->last_usec)
+        return -1.0;
+
+    double watts = (double)(energy - rapl->last_uj) / (double)(now - rapl->last_usec);
+
+    rapl->last_uj = energy;
+    rapl->last_usec = now;
+
+    return watts;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s TARGET_WATTS [-i INTERVAL_MS] [-c] [-p KP] [-k KI] [-b HYSTERESIS_W]\n", name);
+    fprintf(stderr, "          [-t SECONDS] [-r SYSFS_ROOT] [-s] [-v]\n");
+    fprintf(stderr, "  -c  throttle per CCD (last CCD first) instead of the whole package\n");
+    fprintf(stderr, "  -r  prefix for the cpufreq /sys tree, e.g. a fixture\n");
+    fprintf(stderr, "  -s  drive a simulated plant instead of RAPL, in virtual time\n");
+}
+
+int powerlimit_main(int argc, char *argv[])
+{
+    static struct limiter lim;
+    struct settle_tracker st = { 0.0, -1.0, 0.0, false, 0 };
+    struct sim_plant plant = { SIM_FULL_W, 12345u };
+    struct rapl_reader rapl;
+    int opt;
+
+    lim.kp = DEFAULT_KP;
+    lim.ki = DEFAULT_KI;
+    lim.hysteresis_w = DEFAULT_HYSTERESIS_W;
+    lim.interval_ms = DEFAULT_INTERVAL_MS;
+    lim.sysfs_root = "";
+
+    while ((opt = getopt(argc, argv, "i:cp:k:b:t:r:sv")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i': lim.interval_ms = atoi(optarg); break;
+            case 'c': lim.per_ccd = true; break;
+            case 'p': lim.kp = atof(optarg); break;
+            case 'k': lim.ki = atof(optarg); break;
+            case 'b': lim.hysteresis_w = atof(optarg); break;
+            case 't': lim.duration_sec = atof(optarg); break;
+            case 'r': lim.sysfs_root = optarg; break;
+            case 's': lim.simulate = true; break;
+            case 'v': lim.verbose = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (optind >= argc || (lim.target_w = atof(argv[optind])) <= 0.0 || lim.interval_ms <= 0)
+    {
+        usage(argv[0]);
+
+        return 1;
+    }
+
+    // The integral is seeded as output_max / KI, so KI has to be positive; negated checks also catch NaN
+    if (!(lim.kp >= 0.0) || !(lim.ki > 0.0))
+    {
+        fprintf(stderr, "KP must be >= 0 and KI > 0!\n");
+
+        return 1;
+    }
+
+    if (lim.simulate && lim.duration_sec <= 0.0)
+        lim.duration_sec = 10.0;
+
+    if (discover_cores(&lim) != 0)
+    {
+        fprintf(stderr, "No cpufreq cores found!\n");
+
+        return 1;
+    }
+
+    if (!lim.simulate && rapl_open(&rapl) != 0)
+    {
+        restore_cores(&lim);
+
+        return 1;
+    }
+
+    // Closing the terminal must restore the caps too
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGHUP, handle_signal);
+
+    // Gains are per output unit, which is one CCD in CCD mode: the throttled CCD
+    // sits near the top of its f^2.5 curve, so scaling them up by the CCD count
+    // made the loop limit-cycle
+    lim.output_max = lim.per_ccd ? lim.num_ccds : 1.0;
+    lim.output = lim.output_max;
+    lim.integral = lim.output_max / lim.ki;
+
+    printf("Limiting package power to %.1f W on %d cores, %d CCD(s), %d ms interval%s\n",
+           lim.target_w, lim.num_cores, lim.num_ccds, lim.interval_ms, lim.simulate ? " (simulated)" : "");
+
+    double dt = lim.interval_ms / 1000.0;
+    double now_sec = 0.0;
+    int64_t start_usec = get_monotonicTimeUSec();
+
+    while (running && (lim.duration_sec <= 0.0 || now_sec < lim.duration_sec))
+    {
+        double power_w;
+
+        if (lim.simulate)
+        {
+            now_sec += dt;
+            power_w = sim_power(&lim, &plant, dt);
+        }
+        else
+        {
+            usleep(lim.interval_ms * 1000);
+
+            now_sec = (get_monotonicTimeUSec() - start_usec) / (double)USEC;
+            power_w = rapl_watts(&rapl);
+
+            if (power_w < 0.0)
+                continue;
+        }
+
+        settle_update(&st, now_sec, power_w, lim.target_w, lim.hysteresis_w);
+        controller_step(&lim, power_w, dt);
+        apply_output(&lim);
+
+        if (lim.verbose)
+            printf("%8.3f s  %7.2f W  output %.3f  cpu0 %lld MHz\n", now_sec, power_w, lim.output, (long long)lim.cores[0].written_khz / 1000);
+    }
+
+    double settle_sec = settle_time(&st);
+
+    if (settle_sec >= 0)
+        printf("Time-to-settle : %.2f s\n", settle_sec);
+    else
+        printf("Time-to-settle : not settled\n");
+
+    printf("Overshoot      : %.2f W (%.1f%%)\n", st.overshoot_w, 100.0 * st.overshoot_w / lim.target_w);
+
+    restore_cores(&lim);
+
+    return 0;
+}
@@ -5,136 +5,55 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <unistd.h>
-#include <sys/time.h>
 
-#define RAPL_FILE_PATH "/sys/class/powercap/intel-rapl:0/energy_uj"
-#define MAX_PROCESSES 100
-#define MAX_NAME_LENGTH 256
+#include "discovery.h"
+#include "energy.h"
+#include "k10temp.h"
+#include "pressure.h"
+#include "stats.h"
+#include "util.h"
+#include "multicall.h"
+
 #define USEC 1000000
 #define KILO 1000
 #define TO_GB (1024.0 * 1024.0)
 
-int64_t get_memory_usage()
-{
-    FILE *file = fopen("/proc/meminfo", "r");
-
-    if (file == NULL)
-    {
-        perror("fopen");
-
-        return -1;
-    }
+static struct pressure pressure;
+static bool has_pressure;
 
-    char buffer[MAX_NAME_LENGTH];
-    int64_t total_memory = 0;
-    int64_t available_memory = 0;
-
-    size_t bytes_read = fread(buffer, 1, sizeof(buffer) - 1, file);
-    buffer[bytes_read] = '\0';
-
-    fclose(file);
-
-    char *line = strtok(buffer, "\n");
-
-    while (line != NULL)
-    {
-        if (sscanf(line, "MemTotal: %ld kB", &total_memory) == 1)
-        {
-            // Read total memory
-        }
-        else if (sscanf(line, "MemAvailable: %ld kB", &available_memory) == 1)
-        {
-            break;
-        }
-
-        line = strtok(NULL, "\n");
-    }
-
-    if (total_memory == 0 || available_memory == 0)
-        return -1;
-
-    int64_t used_memory_gb = (total_memory - available_memory) / TO_GB;
-
-    return used_memory_gb;
-}
-
-int64_t get_cpuConsumptionUJoules()
+static int sample_pressure(int64_t usec)
 {
-    int64_t consumption;
-    FILE *file = fopen(RAPL_FILE_PATH, "r");
-
-    if (!file || fscanf(file, "%lld", &consumption) != 1)
+    if (!has_pressure && !(has_pressure = pressure_open(&pressure) == 0))
     {
-        perror("Error reading energy consumption!");
-
-        if (file)
-            fclose(file);
+        perror("Error opening /proc/meminfo");
 
         return -1;
     }
 
-    fclose(file);
-
-    return consumption;
+    return pressure_read(&pressure, usec);
 }
 
-int64_t get_currentTimeUSec()
+// MemTotal - MemAvailable from the last sample_pressure()
+static double used_memory_gb()
 {
-    struct timeval tv;
-
-    if (gettimeofday(&tv, NULL) != 0)
-    {
-        perror("Error getting current time!");
-
+    if (pressure.mem_total_kb <= 0 || pressure.mem_available_kb < 0)
         return -1;
-    }
 
-    return ((int64_t)tv.tv_sec * USEC) + tv.tv_usec;
+    return (pressure.mem_total_kb - pressure.mem_available_kb) / TO_GB;
 }
 
-float calculate_cpu_power()
-{
-    int64_t initial_usage = get_cpuConsumptionUJoules();
-    int64_t initial_time = get_currentTimeUSec();
-
-    if (initial_usage == -1 || initial_time == -1)
-        return -1.0f;
-
-    sleep(1);
-
-    int64_t final_usage = get_cpuConsumptionUJoules();
-    int64_t final_time = get_currentTimeUSec();
-
-    if (final_usage == -1 || final_time == -1 || final_time <= initial_time || final_usage <= initial_usage)
-        return -1.0f;
-
-    return (float)((final_usage - initial_usage) / ((final_time - initial_time) / USEC * USEC));
-}
+static struct energy_source energy;
 
-char* execute_command(const char* command)
+static int64_t read_int64_at(const char *dir, const char *file)
 {
-    FILE* fp = popen(command, "r");
+    char path[MAX_NAME_LENGTH * 2];
 
-    if (!fp) return NULL;
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
 
-    char* output = malloc(KILO);
-
-    if (!output) return NULL;
-
-    if (!fgets(output, KILO, fp))
-    {
-        free(output);
-        output = NULL;
-    }
-    else
-        strtok(output, "\n");
-
-    pclose(fp);
-
-    return output;
+    return read_int64_path(path);
 }
 
-bool is_process_running_native(const char* process_name)
+static bool is_process_running_native(const char* process_name)
 {
     DIR* dir = opendir("/proc");
 
@@ -143,7 +62,7 @@ bool is_process_running_native(const char* process_name)
 
     struct dirent* entry;
 
-    char path[MAX_NAME_LENGTH], pname[MAX_NAME_LENGTH], buffer[MAX_NAME_LENGTH];
+    char path[sizeof("/proc//comm") + sizeof(entry->d_name)], pname[MAX_NAME_LENGTH], buffer[MAX_NAME_LENGTH];
 
     while ((entry = readdir(dir)))
     {
@@ -170,73 +89,155 @@ bool is_process_running_native(const char* process_name)
     return false;
 }
 
-int load_process_names(const char* config_file, char process_list[MAX_PROCESSES][MAX_NAME_LENGTH])
+static bool is_any_process_running(char process_list[MAX_PROCESSES][MAX_NAME_LENGTH], int process_count)
 {
-    FILE* fp = fopen(config_file, "r");
-
-    if (!fp)
-        return -1;
+    for (int i = 0; i < process_count; i++)
+        if (is_process_running_native(process_list[i]))
+            return true;
 
-    char line[MAX_NAME_LENGTH];
-    int count = 0;
+    return false;
+}
 
-    while (fgets(line, sizeof(line), fp) && count < MAX_PROCESSES)
-    {
-        strtok(line, "\n");
-        strncpy(process_list[count++], line, MAX_NAME_LENGTH);
-    }
+// Every CCD separated by '/', the hottest one marked with '*' on multi-CCD parts
+static void format_ccd_temps(const struct k10temp *kt, char *buffer, size_t size)
+{
+    size_t len = 0;
 
-    fclose(fp);
+    buffer[0] = '\0';
 
-    return count;
+    for (int i = 0; i < kt->num_ccds && len < size; i++)
+        len += snprintf(buffer + len, size - len, "%s%d%s", i ? "/" : "", kt->ccd_mc[i] / 1000, kt->num_ccds > 1 && i == kt->hottest ? "*" : "");
 }
 
-bool is_any_process_running(char process_list[MAX_PROCESSES][MAX_NAME_LENGTH], int process_count)
+static void print_cpu_info()
 {
-    for (int i = 0; i < process_count; i++)
-        if (is_process_running_native(process_list[i]))
-            return true;
+    struct k10temp kt;
+    char ccd_temps[MAX_NAME_LENGTH];
 
-    return false;
+    if (k10temp_open(&kt) != 0)
+        return;
+
+    k10temp_read(&kt);
+    format_ccd_temps(&kt, ccd_temps, sizeof(ccd_temps));
+
+    struct energy_snapshot start, end;
+    double cpu_power = energy_window_start(&energy, &start) == 0 ? energy_window_end(&energy, &start, USEC, &end) : -1.0;
+
+    sample_pressure(energy.sample_usec);
+
+    double memory_gb = used_memory_gb();
+
+    if (kt.tctl_mc >= 0 && memory_gb > 0)
+        printf("   %.1f GB |    %.0f °C |    %s °C | 󰚥 %.0f W\n", memory_gb, kt.tctl_mc / 1000.0, ccd_temps, cpu_power);
+
+    k10temp_close(&kt);
 }
 
-void print_cpu_info()
+static void watch_cpu_info(int interval_ms, char process_list[MAX_PROCESSES][MAX_NAME_LENGTH], int process_count)
 {
-    char* cpu_temperature1 = execute_command("sensors k10temp-pci-* | awk -F '[:°C]' '/Tctl:/ {print $2}'");
-    char* cpu_temperature2 = execute_command("sensors k10temp-pci-* | awk -F '[:°C]' '/Tccd1:/ {print $2}'");
-    float cpu_power = calculate_cpu_power();
-    float used_memory_gb = get_memory_usage();
+    struct rolling_stats power_stats, tctl_stats;
+    struct stats_summary power_1m, power_5m, tctl_5m;
+    struct k10temp kt;
+    char ccd_temps[MAX_NAME_LENGTH];
+
+    if (k10temp_open(&kt) != 0)
+        return;
+
+    if (stats_init(&power_stats, 0.0, 400.0, 800, interval_ms * 1000LL) != 0 || stats_init(&tctl_stats, 0.0, 120.0, 480, interval_ms * 1000LL) != 0)
+        return;
+
+    struct energy_snapshot previous, current;
+
+    bool has_energy = energy_window_start(&energy, &previous) == 0;
+
+    while (has_energy)
+    {
+        usleep(interval_ms * 1000);
+
+        if (energy_sample(&energy) != 0)
+            continue;
+
+        energy_snapshot(&energy, &current);
+
+        double cpu_power = energy_watts(&previous, &current, -1);
+
+        if (cpu_power < 0)
+            continue;
 
-    if (cpu_temperature1 && cpu_temperature2 && used_memory_gb)
-        printf("   %.1f GB |    %.0f °C |    %.0f °C | 󰚥 %.0f W\n", used_memory_gb, atof(cpu_temperature1), atof(cpu_temperature2), cpu_power);
+        // Same tick as the RAPL read, so a power spike and a stall line up
+        sample_pressure(energy.sample_usec);
+        k10temp_read(&kt);
+        format_ccd_temps(&kt, ccd_temps, sizeof(ccd_temps));
 
-    free(cpu_temperature1);
-    free(cpu_temperature2);
+        double tctl = kt.tctl_mc / 1000.0;
+
+        previous = current;
+
+        stats_push(&power_stats, current.usec, cpu_power);
+
+        if (tctl >= 0)
+            stats_push(&tctl_stats, current.usec, tctl);
+
+        if (is_any_process_running(process_list, process_count))
+        {
+            printf("\n");
+            fflush(stdout);
+
+            continue;
+        }
+
+        stats_get(&power_stats, STATS_1M, &power_1m);
+        stats_get(&power_stats, STATS_5M, &power_5m);
+        stats_get(&tctl_stats, STATS_5M, &tctl_5m);
+
+        printf("   %.1f GB |    %.0f °C |    %s °C | 󰚥 %.0f W | 1m %.0f/%.0f W p95 %.0f | 5m p99 %.0f W | 5m max %.0f °C",
+               used_memory_gb(), tctl, ccd_temps, cpu_power, power_1m.mean, power_1m.max, power_1m.p95, power_5m.p99, tctl_5m.max);
+
+        // Stall shares of the same interval as the power figure, some (and full for memory/io)
+        if (has_pressure && pressure.psi_fds[PSI_CPU] >= 0)
+            printf(" | psi cpu %.0f%% mem %.0f%%/%.0f%% io %.0f%%/%.0f%%", pressure.some[PSI_CPU].share * 100, pressure.some[PSI_MEMORY].share * 100,
+                   pressure.full[PSI_MEMORY].share * 100, pressure.some[PSI_IO].share * 100, pressure.full[PSI_IO].share * 100);
+
+        printf("\n");
+        fflush(stdout);
+    }
+
+    stats_free(&power_stats);
+    stats_free(&tctl_stats);
+    k10temp_close(&kt);
 }
 
-void print_gpu_info()
+// amdgpu exposes everything rocm-smi used to print through its hwmon chip and PCI device
+static void print_gpu_info()
 {
-    char* gpu_usage = execute_command("rocm-smi -d 0 --showuse | awk '/GPU use \\(%\\)/ {print $NF}'");
-    char* gpu_temperature1 = execute_command("rocm-smi -t | awk '/Temperature \\(Sensor edge\\) \\(C\\):/ {print $NF}'");
-    char* gpu_temperature2 = execute_command("rocm-smi -t | awk '/Temperature \\(Sensor junction\\) \\(C\\):/ {print $NF}'");
-    char* gpu_temperature3 = execute_command("rocm-smi -t | awk '/Temperature \\(Sensor memory\\) \\(C\\):/ {print $NF}'");
-    char* gpu_power = execute_command("rocm-smi -P | awk '/Average Graphics Package Power \\(W\\):/ {print $NF}'");
-
-    if (gpu_temperature1 && gpu_temperature2 && gpu_temperature3 && gpu_usage)
-        printf("   %.0f \% |    %.0f °C |    %.0f °C |    %.0f °C | 󰚥 %.0f W\n", atof(gpu_usage), atof(gpu_temperature1), atof(gpu_temperature2), atof(gpu_temperature3), atof(gpu_power));
-
-    free(gpu_usage);
-    free(gpu_temperature1);
-    free(gpu_temperature2);
-    free(gpu_temperature3);
-    free(gpu_power);
+    const struct discovery_hwmon *gpu = discovery_find_hwmon("amdgpu", 0);
+    char path[MAX_NAME_LENGTH];
+
+    if (!gpu)
+        return;
+
+    discovery_hwmon_path(gpu, path, sizeof(path));
+
+    int64_t gpu_usage = read_int64_at(path, "device/gpu_busy_percent");
+    int64_t gpu_temperature1 = read_int64_at(path, "temp1_input");
+    int64_t gpu_temperature2 = read_int64_at(path, "temp2_input");
+    int64_t gpu_temperature3 = read_int64_at(path, "temp3_input");
+    int64_t gpu_power = read_int64_at(path, "power1_average");
+
+    // Newer kernels only report the instantaneous value
+    if (gpu_power < 0)
+        gpu_power = read_int64_at(path, "power1_input");
+
+    if (gpu_temperature1 >= 0 && gpu_temperature2 >= 0 && gpu_temperature3 >= 0 && gpu_usage >= 0)
+        printf("   %.0f %% |    %.0f °C |    %.0f °C |    %.0f °C | 󰚥 %.0f W\n", (float)gpu_usage, gpu_temperature1 / 1000.0, gpu_temperature2 / 1000.0, gpu_temperature3 / 1000.0,
+               gpu_power / 1000000.0);
 }
 
-int main(int argc, char* argv[])
+int powerusage_main(int argc, char *argv[])
 {
     if (argc < 3)
     {
-        fprintf(stderr, "Sintaks: powerusage CONFIG CPU_GPU, Contoh: powerusage ~/.config/daftar_hitam.conf cpu\n", argv[0]);
+        fprintf(stderr, "Sintaks: powerusage CONFIG CPU_GPU [INTERVAL_MS], Contoh: powerusage ~/.config/daftar_hitam.conf cpu 1000\n");
 
         return 1;
     }
@@ -244,7 +245,17 @@ int main(int argc, char* argv[])
     char process_list[MAX_PROCESSES][MAX_NAME_LENGTH];
     int process_count = load_process_names(argv[1], process_list);
 
-    if (process_count == -1 || is_any_process_running(process_list, process_count))
+    if (process_count == -1)
+        return 1;
+
+    if (argc > 3 && strcmp(argv[2], "cpu") == 0 && atoi(argv[3]) > 0)
+    {
+        watch_cpu_info(atoi(argv[3]), process_list, process_count);
+
+        return 1;
+    }
+
+    if (is_any_process_running(process_list, process_count))
         return 1;
 
     if (strcmp(argv[2], "cpu") == 0)
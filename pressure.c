@@ -0,0 +1,216 @@
+#include "pressure.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MEMINFO_PATH "/proc/meminfo"
+#define PSI_PATH "/proc/pressure/"
+#define MEMINFO_BUFFER_SIZE 8192
+#define PSI_BUFFER_SIZE 256
+#define USEC 1000000
+
+static const char *psi_names[PSI_RESOURCES] = { "cpu", "memory", "io" };
+
+static int64_t parse_int(const char **cursor, const char *end)
+{
+    const char *c = *cursor;
+    int64_t value = 0;
+
+    while (c < end && (*c == ' ' || *c == '\t'))
+        c++;
+
+    while (c < end && *c >= '0' && *c <= '9')
+        value = value * 10 + (*c++ - '0');
+
+    *cursor = c;
+
+    return value;
+}
+
+// PSI averages are printed as "%lu.%02lu"
+static double parse_decimal(const char **cursor, const char *end)
+{
+    double value = parse_int(cursor, end);
+    double scale = 0.1;
+
+    if (*cursor < end && **cursor == '.')
+    {
+        for ((*cursor)++; *cursor < end && **cursor >= '0' && **cursor <= '9'; (*cursor)++, scale /= 10)
+            value += (**cursor - '0') * scale;
+    }
+
+    return value;
+}
+
+static int parse_meminfo(struct pressure *p, const char *c, const char *end)
+{
+    p->num_meminfo = 0;
+    p->mem_total_kb = -1;
+    p->mem_available_kb = -1;
+
+    while (c < end && p->num_meminfo < PRESSURE_MAX_MEMINFO)
+    {
+        struct meminfo_field *field = &p->meminfo[p->num_meminfo];
+        const char *colon = memchr(c, ':', end - c);
+        size_t len;
+
+        if (!colon)
+            break;
+
+        len = colon - c < (long)sizeof(field->name) - 1 ? (size_t)(colon - c) : sizeof(field->name) - 1;
+        memcpy(field->name, c, len);
+        field->name[len] = '\0';
+        c = colon + 1;
+        field->kb = parse_int(&c, end);
+
+        if (strcmp(field->name, "MemTotal") == 0)
+            p->mem_total_kb = field->kb;
+        else if (strcmp(field->name, "MemAvailable") == 0)
+            p->mem_available_kb = field->kb;
+
+        p->num_meminfo++;
+
+        const char *newline = memchr(c, '\n', end - c);
+
+        c = newline ? newline + 1 : end;
+    }
+
+    return p->mem_total_kb > 0 && p->mem_available_kb >= 0 ? 0 : -1;
+}
+
+// "some avg10=0.00 avg60=0.00 avg300=0.00 total=0", then the same for "full"
+static void parse_psi_line(struct psi_stall *stall, const char *c, const char *end, int64_t elapsed_usec)
+{
+    int64_t previous_total = stall->total_usec;
+
+    while (c < end && *c != '\n')
+    {
+        if (end - c > 6 && memcmp(c, "avg10=", 6) == 0)
+            c += 6, stall->avg10 = parse_decimal(&c, end);
+        else if (end - c > 6 && memcmp(c, "avg60=", 6) == 0)
+            c += 6, stall->avg60 = parse_decimal(&c, end);
+        else if (end - c > 7 && memcmp(c, "avg300=", 7) == 0)
+            c += 7, stall->avg300 = parse_decimal(&c, end);
+        else if (end - c > 6 && memcmp(c, "total=", 6) == 0)
+            c += 6, stall->total_usec = parse_int(&c, end);
+        else
+            c++;
+    }
+
+    if (elapsed_usec > 0 && stall->total_usec >= previous_total)
+    {
+        stall->share = (double)(stall->total_usec - previous_total) / elapsed_usec;
+
+        if (stall->share > 1.0)
+            stall->share = 1.0;
+    }
+    else
+        stall->share = 0.0;
+}
+
+static void parse_psi(struct psi_stall *some, struct psi_stall *full, const char *c, const char *end, int64_t elapsed_usec)
+{
+    while (c < end)
+    {
+        const char *newline = memchr(c, '\n', end - c);
+        const char *line_end = newline ? newline : end;
+
+        if (line_end - c > 5 && memcmp(c, "some ", 5) == 0)
+            parse_psi_line(some, c + 5, line_end, elapsed_usec);
+        else if (line_end - c > 5 && memcmp(c, "full ", 5) == 0)
+            parse_psi_line(full, c + 5, line_end, elapsed_usec);
+
+        c = newline ? newline + 1 : end;
+    }
+}
+
+int pressure_open(struct pressure *p)
+{
+    char path[64];
+
+    memset(p, 0, sizeof(*p));
+    p->meminfo_fd = open(MEMINFO_PATH, O_RDONLY | O_CLOEXEC);
+
+    // Kernels without CONFIG_PSI have no /proc/pressure, memory still works
+    for (int i = 0; i < PSI_RESOURCES; i++)
+    {
+        snprintf(path, sizeof(path), PSI_PATH "%s", psi_names[i]);
+        p->psi_fds[i] = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    return p->meminfo_fd >= 0 ? 0 : -1;
+}
+
+void pressure_close(struct pressure *p)
+{
+    if (p->meminfo_fd >= 0)
+        close(p->meminfo_fd);
+
+    for (int i = 0; i < PSI_RESOURCES; i++)
+        if (p->psi_fds[i] >= 0)
+            close(p->psi_fds[i]);
+
+    p->meminfo_fd = -1;
+
+    for (int i = 0; i < PSI_RESOURCES; i++)
+        p->psi_fds[i] = -1;
+}
+
+/*
+ * One pass over every open file. usec is the caller's CLOCK_MONOTONIC
+ * timestamp for this tick (energy_source.sample_usec), 0 to take a fresh one.
+ */
+int pressure_read(struct pressure *p, int64_t usec)
+{
+    char buffer[MEMINFO_BUFFER_SIZE];
+    int failed = 0;
+
+    if (usec == 0)
+    {
+        struct timespec time;
+
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        usec = (int64_t)time.tv_sec * USEC + time.tv_nsec / 1000;
+    }
+
+    int64_t elapsed_usec = p->sample_usec > 0 ? usec - p->sample_usec : 0;
+
+    p->sample_usec = usec;
+
+    if (p->meminfo_fd >= 0)
+    {
+        ssize_t len = pread(p->meminfo_fd, buffer, sizeof(buffer), 0);
+
+        if (len <= 0 || parse_meminfo(p, buffer, buffer + len) != 0)
+            failed++;
+    }
+    else
+        failed++;
+
+    for (int i = 0; i < PSI_RESOURCES; i++)
+    {
+        if (p->psi_fds[i] < 0)
+            continue;
+
+        ssize_t len = pread(p->psi_fds[i], buffer, PSI_BUFFER_SIZE, 0);
+
+        if (len > 0)
+            parse_psi(&p->some[i], &p->full[i], buffer, buffer + len, elapsed_usec);
+        else
+            failed++;
+    }
+
+    return failed ? -1 : 0;
+}
+
+int64_t pressure_meminfo(const struct pressure *p, const char *name)
+{
+    for (int i = 0; i < p->num_meminfo; i++)
+        if (strcmp(p->meminfo[i].name, name) == 0)
+            return p->meminfo[i].kb;
+
+    return -1;
+}
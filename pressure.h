@@ -0,0 +1,57 @@
+#ifndef PRESSURE_H
+#define PRESSURE_H
+
+#include <stdint.h>
+
+#define PRESSURE_MAX_MEMINFO 128
+
+enum psi_resource
+{
+    PSI_CPU,
+    PSI_MEMORY,
+    PSI_IO,
+    PSI_RESOURCES
+};
+
+struct psi_stall
+{
+    double avg10;
+    double avg60;
+    double avg300;
+    int64_t total_usec;
+    double share;
+};
+
+struct meminfo_field
+{
+    char name[24];
+    int64_t kb;
+};
+
+/*
+ * /proc/meminfo and /proc/pressure/{cpu,memory,io} kept open and re-read
+ * with pread() into a fixed buffer, parsed without stdio. Every meminfo line
+ * is kept by name, so nothing depends on the order the kernel prints them in.
+ * share is the fraction of the time since the previous pressure_read() that
+ * tasks were stalled, taken from the total= counters; passing the RAPL sample
+ * timestamp lines it up with the power figure of the same tick.
+ */
+struct pressure
+{
+    int meminfo_fd;
+    struct meminfo_field meminfo[PRESSURE_MAX_MEMINFO];
+    int num_meminfo;
+    int64_t mem_total_kb;
+    int64_t mem_available_kb;
+    int psi_fds[PSI_RESOURCES];
+    struct psi_stall some[PSI_RESOURCES];
+    struct psi_stall full[PSI_RESOURCES];
+    int64_t sample_usec;
+};
+
+int pressure_open(struct pressure *p);
+void pressure_close(struct pressure *p);
+int pressure_read(struct pressure *p, int64_t usec);
+int64_t pressure_meminfo(const struct pressure *p, const char *name);
+
+#endif
@@ -1,40 +1,52 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "energy.h"
+#include "k10temp.h"
+#include "pressure.h"
+#include "stats.h"
+#include "throttle.h"
+#include "util.h"
+#include "multicall.h"
 
-#define RAPL_PATH "/sys/class/powercap/intel-rapl:0/energy_uj"
 #define USEC 1000000
+#define DEFAULT_WATCH_MS 1000
+#define DEFAULT_BENCH_SAMPLES 10000
+#define BENCH_MAX_PACKAGES 8
+#define DEFAULT_RUN_POLL_MS 100
+#define DEFAULT_THROTTLE_MS 250
+#define CPU_PATH "/sys/devices/system/cpu"
+#define TRACE_LINE_LENGTH 4096
 
 static int64_t last_read_time = 0;
 static int64_t cached_consumption = -1;
+static struct energy_source energy;
 
-int64_t get_monotonicTimeUSec()
-{
-    struct timespec time;
-
-    clock_gettime(CLOCK_MONOTONIC, &time);
-
-    return time.tv_sec * USEC + time.tv_nsec / 1000;
-}
-
-int64_t get_cpuConsumptionUJoules()
+static int64_t get_cpuConsumptionUJoules()
 {
     int64_t current_time = get_monotonicTimeUSec();
 
     if (current_time - last_read_time >= USEC)
     {
-        FILE *file = fopen(RAPL_PATH, "r");
+        if (energy.backend == ENERGY_NONE && energy_open(&energy) != 0)
+            return -1;
 
-        if (file != NULL)
-        {
-            if (fscanf(file, "%lld", &cached_consumption) != 1)
-                cached_consumption = -1;
+        cached_consumption = energy_read(&energy);
 
-            fclose(file);
-        }
-        else
-            perror("Failed to open RAPL path");
+        if (cached_consumption < 0)
+            perror("Failed to read RAPL energy");
 
         last_read_time = current_time;
     }
@@ -42,7 +54,7 @@ int64_t get_cpuConsumptionUJoules()
     return cached_consumption;
 }
 
-float get_cpuConsumptionWatts()
+static float get_cpuConsumptionWatts()
 {
     static int64_t previous_usage = -1;
     static int64_t previous_timestamp = 0;
@@ -71,8 +83,604 @@ float get_cpuConsumptionWatts()
     return watts;
 }
 
-int main()
+static void print_window(const char *unit, const struct stats_summary *s)
+{
+    printf(" %7.2f %7.2f %7.2f %7.2f %7.2f %-2s", s->min, s->mean, s->max, s->p95, s->p99, unit);
+}
+
+static int watch(int interval_ms)
+{
+    struct rolling_stats power_stats, tctl_stats;
+    struct stats_summary summary;
+    struct k10temp kt;
+    struct pressure pressure;
+    bool has_k10temp = k10temp_open(&kt) == 0 && kt.tctl_fd >= 0;
+    bool has_pressure = pressure_open(&pressure) == 0;
+
+    if (energy_open(&energy) != 0)
+        return 1;
+
+    if (stats_init(&power_stats, 0.0, 400.0, 800, interval_ms * 1000LL) != 0 || stats_init(&tctl_stats, 0.0, 120.0, 480, interval_ms * 1000LL) != 0)
+    {
+        fprintf(stderr, "Failed to allocate statistics windows!\n");
+
+        return 1;
+    }
+
+    struct energy_snapshot previous, current;
+
+    energy_snapshot(&energy, &previous);
+
+    if (has_pressure)
+        pressure_read(&pressure, previous.usec);
+
+    while (1)
+    {
+        usleep(interval_ms * 1000);
+
+        if (energy_sample(&energy) != 0)
+            continue;
+
+        energy_snapshot(&energy, &current);
+
+        double watts = energy_watts(&previous, &current, -1);
+        double tctl = has_k10temp && k10temp_read(&kt) == 0 ? kt.tctl_mc / 1000.0 : -1.0;
+
+        if (has_pressure)
+            pressure_read(&pressure, current.usec);
+
+        if (watts < 0)
+            continue;
+
+        stats_push(&power_stats, current.usec, watts);
+
+        if (tctl >= 0)
+            stats_push(&tctl_stats, current.usec, tctl);
+
+        printf("\n%.2f W", watts);
+
+        for (int i = 0; energy.num_packages > 1 && i < energy.num_packages; i++)
+            printf("%s%.2f W", i ? " + " : " = ", energy_watts(&previous, &current, i));
+
+        if (tctl >= 0)
+            printf("  %.1f°C", tctl);
+
+        if (has_pressure)
+            printf("  %.1f GB", (pressure.mem_total_kb - pressure.mem_available_kb) / (1024.0 * 1024.0));
+
+        if (has_pressure && pressure.psi_fds[PSI_CPU] >= 0)
+            printf("  stall cpu %.0f%% mem %.0f%%/%.0f%% io %.0f%%/%.0f%%", pressure.some[PSI_CPU].share * 100, pressure.some[PSI_MEMORY].share * 100,
+                   pressure.full[PSI_MEMORY].share * 100, pressure.some[PSI_IO].share * 100, pressure.full[PSI_IO].share * 100);
+
+        printf("\n");
+        previous = current;
+        printf("      %7s %7s %7s %7s %7s\n", "min", "mean", "max", "p95", "p99");
+
+        for (int w = 0; w < STATS_WINDOWS; w++)
+        {
+            printf("%-4s ", stats_window_name(w));
+            stats_get(&power_stats, w, &summary);
+            print_window("W", &summary);
+
+            if (has_k10temp)
+            {
+                stats_get(&tctl_stats, w, &summary);
+                print_window("°C", &summary);
+            }
+
+            printf("\n");
+        }
+
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+/*
+ * Times energy_sample() with the package counters replicated up to
+ * BENCH_MAX_PACKAGES, so a single-socket box shows how the pass scales.
+ * The sample window itself stays the sleep interval: every counter in a
+ * pass shares one timestamp, only the read span grows.
+ */
+static int bench(int samples)
+{
+    struct energy_source src;
+
+    if (energy_open(&src) != 0)
+        return 1;
+
+    int real_packages = src.num_packages;
+    int real_zones = src.num_zones;
+
+    printf("Backend %s, %d package(s), %d zone(s), %d samples per row\n", energy_backend_name(src.backend), real_packages, real_zones, samples);
+    printf("%8s %12s %12s %14s\n", "packages", "mean (ns)", "max (ns)", "per pkg (ns)");
+
+    src.num_zones = 0;
+
+    for (int packages = 1; packages <= BENCH_MAX_PACKAGES; packages *= 2)
+    {
+        int64_t total_ns = 0, max_ns = 0;
+
+        for (int i = real_packages; i < packages; i++)
+            src.packages[i] = src.packages[i % real_packages];
+
+        src.num_packages = packages;
+
+        for (int i = 0; i < samples; i++)
+        {
+            struct timespec start, end;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            energy_sample(&src);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            int64_t ns = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+
+            total_ns += ns;
+
+            if (ns > max_ns)
+                max_ns = ns;
+        }
+
+        printf("%8d %12lld %12lld %14lld\n", packages, (long long)(total_ns / samples), (long long)max_ns, (long long)(total_ns / samples / packages));
+    }
+
+    src.num_packages = real_packages;
+    src.num_zones = real_zones;
+    energy_close(&src);
+
+    return 0;
+}
+
+struct run_result
+{
+    double seconds;
+    double joules;
+    double peak_watts;
+    double cpu_seconds;
+    int polls;
+    int status;
+    bool has_usage;
+};
+
+static void print_run_result(FILE *out, char *const command[], const struct run_result *result)
+{
+    double average_watts = result->seconds > 0 ? result->joules / result->seconds : 0.0;
+    double joules_per_cpu_second = result->cpu_seconds > 0 ? result->joules / result->cpu_seconds : 0.0;
+
+    fprintf(out, "{\"command\":\"");
+
+    for (int i = 0; command[i]; i++)
+    {
+        for (const char *c = command[i]; *c; c++)
+        {
+            if (*c == '"' || *c == '\\')
+                fputc('\\', out);
+
+            if ((unsigned char)*c >= 0x20)
+                fputc(*c, out);
+        }
+
+        if (command[i + 1])
+            fputc(' ', out);
+    }
+
+    fprintf(out, "\",\"backend\":\"%s\",", energy_backend_name(energy.backend));
+
+    // Without wait4 there is no exit status or rusage, leave them out rather than print garbage
+    if (result->has_usage)
+        fprintf(out, "\"exit_status\":%d,", result->status);
+
+    fprintf(out, "\"runtime_s\":%.6f,\"energy_j\":%.3f,\"avg_w\":%.3f,\"peak_w\":%.3f,", result->seconds, result->joules, average_watts, result->peak_watts);
+
+    if (result->has_usage)
+        fprintf(out, "\"cpu_s\":%.6f,\"j_per_cpu_s\":%.3f,", result->cpu_seconds, joules_per_cpu_second);
+
+    fprintf(out, "\"samples\":%d}\n", result->polls);
+}
+
+/*
+ * ryzen run -- CMD: RAPL is sampled right before the fork and right after
+ * the child is reaped. In between the counters are polled every poll_ms,
+ * which folds in counter wraps and gives the peak watts; a pidfd wakes the
+ * loop as soon as the child exits.
+ */
+static int run(int argc, char *argv[])
+{
+    const char *output_path = NULL;
+    int poll_ms = DEFAULT_RUN_POLL_MS;
+    int first = 2;
+
+    for (; first < argc && strcmp(argv[first], "--") != 0; first++)
+    {
+        if (strcmp(argv[first], "-o") == 0 && first + 1 < argc)
+            output_path = argv[++first];
+        else if (strcmp(argv[first], "-i") == 0 && first + 1 < argc)
+            poll_ms = atoi(argv[++first]);
+        else
+            break;
+    }
+
+    if (first >= argc || strcmp(argv[first], "--") != 0 || first + 1 >= argc || poll_ms <= 0)
+    {
+        fprintf(stderr, "Usage: %s run [-o FILE] [-i POLL_MS] -- COMMAND [ARGS...]\n", argv[0]);
+
+        return 2;
+    }
+
+    char **command = &argv[first + 1];
+    struct energy_snapshot start, previous, current;
+    struct run_result result = { 0 };
+    struct rusage usage = { 0 };
+    int status = 0;
+
+    if (energy_open(&energy) != 0)
+        return 2;
+
+    energy_sample(&energy);
+    energy_snapshot(&energy, &start);
+    previous = start;
+
+    pid_t pid = fork();
+
+    if (pid < 0)
+    {
+        perror("fork");
+
+        return 2;
+    }
+
+    if (pid == 0)
+    {
+        execvp(command[0], command);
+        perror(command[0]);
+        _exit(127);
+    }
+
+    // Like time(1), leave terminal signals to the child
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+
+    while (1)
+    {
+        pid_t done = wait4(pid, &status, WNOHANG, &usage);
+
+        if (done == pid)
+        {
+            result.has_usage = true;
+
+            break;
+        }
+
+        if (done < 0 && errno != EINTR)
+        {
+            perror("wait4");
+
+            break;
+        }
+
+        if (pidfd >= 0)
+        {
+            struct pollfd pfd = { pidfd, POLLIN, 0 };
+
+            poll(&pfd, 1, poll_ms);
+        }
+        else
+            usleep(poll_ms * 1000);
+
+        if (energy_sample(&energy) != 0)
+            continue;
+
+        energy_snapshot(&energy, &current);
+
+        double watts = energy_watts(&previous, &current, -1);
+
+        // Very short final slices overstate the rate, only full polls count for the peak
+        if (watts > result.peak_watts && current.usec - previous.usec >= poll_ms * 1000 / 2)
+            result.peak_watts = watts;
+
+        previous = current;
+        result.polls++;
+    }
+
+    energy_sample(&energy);
+    energy_snapshot(&energy, &current);
+
+    if (pidfd >= 0)
+        close(pidfd);
+
+    result.seconds = (current.usec - start.usec) / (double)USEC;
+    result.joules = (current.total_uj - start.total_uj) / (double)USEC;
+
+    if (result.has_usage)
+    {
+        result.cpu_seconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / (double)USEC;
+        result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    else
+        result.status = 2;
+
+    if (result.peak_watts == 0.0 && result.seconds > 0)
+        result.peak_watts = result.joules / result.seconds;
+
+    FILE *out = output_path ? fopen(output_path, "a") : stderr;
+
+    if (!out)
+    {
+        perror(output_path);
+
+        out = stderr;
+    }
+
+    print_run_result(out, command, &result);
+
+    if (out != stderr)
+        fclose(out);
+
+    return result.status;
+}
+
+static volatile sig_atomic_t throttle_running = 1;
+
+static void stop_throttle(int sig)
+{
+    (void)sig;
+
+    throttle_running = 0;
+}
+
+static void report_episode(FILE *log, const struct throttle_detector *d, const struct throttle_episode *e)
+{
+    printf("throttle #%llu: %s for %.2f s, %.0f MHz-s lost (%.0f -> %.0f MHz, peak %.1f°C %.1f W)\n", (unsigned long long)d->episodes, throttle_reason_name(e->reasons),
+           (double)(e->end_usec - e->start_usec) / USEC, e->lost_mhz_s, e->reference_mhz, e->min_mhz, e->peak_tctl, e->peak_watts);
+
+    if (log)
+        throttle_log(log, e);
+}
+
+static void print_throttle_summary(const struct throttle_detector *d)
+{
+    printf("%llu throttle episode(s), %.2f s, %.0f MHz-s lost\n", (unsigned long long)d->episodes, d->total_s, d->total_lost_mhz_s);
+}
+
+static int parse_mhz_list(char *cursor, double *mhz)
+{
+    int count = 0;
+    char *end;
+
+    for (; count < THROTTLE_MAX_CORES; cursor = end)
+    {
+        double value = strtod(cursor, &end);
+
+        if (end == cursor)
+            break;
+
+        mhz[count++] = value;
+    }
+
+    return count;
+}
+
+/*
+ * Replays a trace written by "ryzen throttle -w": one sample per line,
+ * "usec tctl watts mhz0 mhz1 ...", '#' starts a comment.
+ */
+static int replay_throttle(struct throttle_detector *d, const char *path, FILE *log)
+{
+    static double freq_mhz[THROTTLE_MAX_CORES];
+    struct throttle_episode episode;
+    char line[TRACE_LINE_LENGTH];
+    FILE *trace = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+    if (!trace)
+    {
+        perror(path);
+
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), trace))
+    {
+        char *cursor = line, *end;
+
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        int64_t usec = strtoll(cursor, &end, 10);
+        double tctl = strtod(end, &cursor);
+        double watts = strtod(cursor, &end);
+
+        if (end == cursor)
+            continue;
+
+        int num_cores = parse_mhz_list(end, freq_mhz);
+
+        if (throttle_update(d, usec, tctl, watts, freq_mhz, num_cores, &episode))
+            report_episode(log, d, &episode);
+    }
+
+    if (throttle_finish(d, &episode))
+        report_episode(log, d, &episode);
+
+    if (trace != stdin)
+        fclose(trace);
+
+    print_throttle_summary(d);
+
+    return 0;
+}
+
+static int throttle(int argc, char *argv[])
 {
+    static double freq_mhz[THROTTLE_MAX_CORES];
+    static int freq_fds[THROTTLE_MAX_CORES];
+    struct throttle_config config;
+    struct throttle_detector detector;
+    struct throttle_episode episode;
+    const char *log_path = NULL, *trace_path = NULL, *replay_path = NULL;
+    int interval_ms = DEFAULT_THROTTLE_MS;
+    FILE *log = NULL, *trace = NULL;
+
+    throttle_default_config(&config);
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            interval_ms = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            log_path = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            config.tctl_limit = atof(argv[++i]);
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+            config.power_limit = atof(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            trace_path = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            replay_path = argv[++i];
+        else
+        {
+            interval_ms = 0;
+
+            break;
+        }
+    }
+
+    if (interval_ms <= 0)
+    {
+        fprintf(stderr, "Usage: %s throttle [-i INTERVAL_MS] [-l LOG] [-t TCTL_LIMIT] [-p POWER_LIMIT] [-w TRACE | -r TRACE]\n", argv[0]);
+
+        return 2;
+    }
+
+    throttle_init(&detector, &config);
+
+    if (log_path && !(log = fopen(log_path, "a")))
+    {
+        perror(log_path);
+
+        return 1;
+    }
+
+    if (replay_path)
+    {
+        int result = replay_throttle(&detector, replay_path, log);
+
+        if (log)
+            fclose(log);
+
+        return result;
+    }
+
+    struct k10temp kt;
+    struct energy_snapshot previous, current;
+    bool has_k10temp = k10temp_open(&kt) == 0 && kt.tctl_fd >= 0;
+    int num_cores = 0;
+
+    for (; num_cores < THROTTLE_MAX_CORES; num_cores++)
+    {
+        char path[128];
+
+        snprintf(path, sizeof(path), CPU_PATH "/cpu%d/cpufreq/scaling_cur_freq", num_cores);
+
+        if ((freq_fds[num_cores] = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+            break;
+    }
+
+    if (energy_open(&energy) != 0)
+        return 1;
+
+    if (trace_path && (trace = fopen(trace_path, "w")))
+        fprintf(trace, "# usec tctl watts, then MHz for each of %d core(s)\n", num_cores);
+    else if (trace_path)
+        perror(trace_path);
+
+    printf("Limits: Tctl %.1f°C, package %.1f W, %d core(s)\n", config.tctl_limit, config.power_limit, num_cores);
+
+    signal(SIGINT, stop_throttle);
+    signal(SIGTERM, stop_throttle);
+    energy_snapshot(&energy, &previous);
+
+    while (throttle_running)
+    {
+        usleep(interval_ms * 1000);
+
+        if (energy_sample(&energy) != 0)
+            continue;
+
+        energy_snapshot(&energy, &current);
+
+        struct timespec now;
+        double watts = energy_watts(&previous, &current, -1);
+        double tctl = has_k10temp && k10temp_read(&kt) == 0 ? kt.tctl_mc / 1000.0 : -1.0;
+        double average = 0.0;
+
+        previous = current;
+
+        for (int i = 0; i < num_cores; i++)
+        {
+            char buffer[32];
+            ssize_t len = pread(freq_fds[i], buffer, sizeof(buffer) - 1, 0);
+
+            buffer[len > 0 ? len : 0] = '\0';
+            freq_mhz[i] = atoi(buffer) / 1000.0;
+            average += freq_mhz[i] / num_cores;
+        }
+
+        // Wall-clock timestamps, so log entries can be matched against other logs
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        int64_t usec = (int64_t)now.tv_sec * USEC + now.tv_nsec / 1000;
+
+        if (trace)
+        {
+            fprintf(trace, "%lld %.1f %.2f", (long long)usec, tctl, watts);
+
+            for (int i = 0; i < num_cores; i++)
+                fprintf(trace, " %.0f", freq_mhz[i]);
+
+            fprintf(trace, "\n");
+        }
+
+        if (throttle_update(&detector, usec, tctl, watts, freq_mhz, num_cores, &episode))
+            report_episode(log, &detector, &episode);
+
+        printf("%7.2f W  %5.1f°C  %5.0f MHz  %s throttles %llu (%.1f s, %.0f MHz-s lost)\n", watts, tctl, average,
+               detector.active ? "THROTTLING" : detector.at_limit ? "at limit  " : "          ", (unsigned long long)detector.episodes, detector.total_s,
+               detector.total_lost_mhz_s);
+        fflush(stdout);
+    }
+
+    if (throttle_finish(&detector, &episode))
+        report_episode(log, &detector, &episode);
+
+    print_throttle_summary(&detector);
+
+    if (trace)
+        fclose(trace);
+
+    if (log)
+        fclose(log);
+
+    return 0;
+}
+
+int ryzen_main(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "run") == 0)
+        return run(argc, argv);
+
+    if (argc > 1 && strcmp(argv[1], "throttle") == 0)
+        return throttle(argc, argv);
+
+    if (argc > 1 && strcmp(argv[1], "-w") == 0)
+        return watch(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : DEFAULT_WATCH_MS);
+
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+        return bench(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : DEFAULT_BENCH_SAMPLES);
+
     printf("%.2f\n", get_cpuConsumptionWatts());
 
     return 0;
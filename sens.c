@@ -1,364 +1,450 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+
+#include "discovery.h"
+#include "energy.h"
+#include "util.h"
+#include "multicall.h"
 
-#define RAPL_FILE_PATH "/sys/class/powercap/intel-rapl:0/energy_uj"
 #define BOARD_NAME_PATH "/sys/devices/virtual/dmi/id/board_name"
+#define DEFAULT_CONFIG "sens.conf"
+#define USER_CONFIG "/.config/ryzen-power/sens.conf"
 #define BUFFER_SIZE 256
+#define MAX_CHIPS 64
+#define MAX_CHANNELS 32
+#define MAX_ENTRIES 128
+#define MAX_GROUPS 32
+#define NAME_LENGTH 32
 #define USEC 1000000
 
 #define BOLD "\033[1m"
 #define RESET "\033[0m"
 
-int64_t get_cpuConsumptionUJoules()
+enum sensor_kind
+{
+    KIND_TEMP,
+    KIND_FAN,
+    KIND_POWER,
+    KIND_VOLTAGE,
+    KIND_RAPL
+};
+
+struct chip
+{
+    char name[NAME_LENGTH];
+    char model[DISCOVERY_MODEL_LENGTH];
+    char path[BUFFER_SIZE];
+    int number;
+    int instance;
+};
+
+/*
+ * The read plan: one entry per output line, resolved once from the config.
+ * A tick is a pread per fd, an integer parse and a multiply into values[];
+ * nothing is formatted or looked up by path after startup.
+ */
+struct plan_entry
 {
-    int64_t consumption = -1;
-    FILE *file = fopen(RAPL_FILE_PATH, "r");
+    int fd;
+    enum sensor_kind kind;
+    double scale;
+    int group;
+    int set;
+    char name[NAME_LENGTH];
+};
+
+struct read_plan
+{
+    struct plan_entry entries[MAX_ENTRIES];
+    double values[MAX_ENTRIES];
+    bool valid[MAX_ENTRIES];
+    int num_entries;
+    char groups[MAX_GROUPS][BUFFER_SIZE];
+    int num_groups;
+    int num_sets;
+    bool has_rapl;
+};
+
+static struct chip chips[MAX_CHIPS];
+static int num_chips;
+static struct energy_source energy;
+static struct energy_snapshot previous_snapshot, current_snapshot;
+
+static const char *kind_prefixes[] = { "temp", "fan", "power", "in" };
+static const double kind_scales[] = { 0.001, 1.0, 0.000001, 0.001 };
+
+static char *trim(char *text)
+{
+    while (isspace((unsigned char)*text))
+        text++;
 
-    if (file && fscanf(file, "%lld", &consumption) == 1)
-        fclose(file);
-    else
-    {
-        perror("Error reading RAPL energy file");
+    char *end = text + strlen(text);
 
-        if (file) fclose(file);
-    }
+    while (end > text && isspace((unsigned char)end[-1]))
+        *--end = '\0';
 
-    return consumption;
+    return text;
 }
 
-int64_t get_currentTimeUSec()
+// Chips come from the discovery cache, already sorted by hwmon number with "@N" instances counted
+static void discover_chips()
 {
-    struct timeval tv;
-
-    if (gettimeofday(&tv, NULL) == 0)
-        return ((int64_t)tv.tv_sec * USEC) + tv.tv_usec;
+    const struct discovery *d = discovery_get();
 
-    perror("Error getting current time");
+    for (int i = 0; i < d->num_hwmon && num_chips < MAX_CHIPS; i++)
+    {
+        struct chip *chip = &chips[num_chips++];
 
-    return -1;
+        snprintf(chip->name, sizeof(chip->name), "%s", d->hwmon[i].name);
+        snprintf(chip->model, sizeof(chip->model), "%s", d->hwmon[i].model);
+        discovery_hwmon_path(&d->hwmon[i], chip->path, sizeof(chip->path));
+        chip->number = d->hwmon[i].number;
+        chip->instance = d->hwmon[i].instance;
+    }
 }
 
-float calculate_cpu_power()
+// "nct668*" matches the first chip with that name, "spd5118@1" the second one
+static const struct chip *find_chip(const char *spec)
 {
-    int64_t initial_usage = get_cpuConsumptionUJoules();
-    int64_t initial_time = get_currentTimeUSec();
+    char pattern[NAME_LENGTH];
+    int instance = 0;
 
-    if (initial_usage == -1 || initial_time == -1)
-    {
-        fprintf(stderr, "Failed to read initial CPU consumption or time data\n");
+    snprintf(pattern, sizeof(pattern), "%s", spec);
 
-        return 0.0f;
+    char *at = strchr(pattern, '@');
+
+    if (at)
+    {
+        *at = '\0';
+        instance = atoi(at + 1);
     }
 
-    usleep(USEC);
+    for (int i = 0, seen = 0; i < num_chips; i++)
+        if (fnmatch(pattern, chips[i].name, 0) == 0 && seen++ == instance)
+            return &chips[i];
 
-    int64_t final_usage = get_cpuConsumptionUJoules();
-    int64_t final_time = get_currentTimeUSec();
+    return NULL;
+}
 
-    if (final_usage == -1 || final_time == -1 || final_time < initial_time)
-    {
-        fprintf(stderr, "Failed to read final CPU consumption or time data, or time went backwards\n");
+static int add_entry(struct read_plan *plan, const char *path, enum sensor_kind kind, const char *name, int set)
+{
+    if (plan->num_entries >= MAX_ENTRIES)
+        return -1;
 
-        return 0.0f;
-    }
+    int fd = kind == KIND_RAPL ? -1 : open(path, O_RDONLY | O_CLOEXEC);
 
-    int64_t time_diff_usec = final_time - initial_time;
-    int64_t energy_diff_uj = final_usage - initial_usage;
+    if (fd < 0 && kind != KIND_RAPL)
+        return -1;
 
-    if (time_diff_usec <= 0 || energy_diff_uj < 0)
-    {
-        fprintf(stderr, "Invalid time or energy difference\n");
+    struct plan_entry *entry = &plan->entries[plan->num_entries++];
 
-        return 0.0f;
-    }
+    entry->fd = fd;
+    entry->kind = kind;
+    entry->scale = kind == KIND_RAPL ? 1.0 : kind_scales[kind];
+    entry->group = plan->num_groups - 1;
+    entry->set = set;
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
 
-    return (float)(energy_diff_uj) / (time_diff_usec / (float)USEC);
+    return 0;
 }
 
-int read_int_from_file(const char *path)
+/*
+ * A sensor is either a channel ("temp2", "fan1", "power1_average") or a
+ * label glob ("Tctl", "Tccd*", "edge"). Globs may match several channels;
+ * with a display name of "*" each match is shown under its own label.
+ */
+static int resolve_sensor(struct read_plan *plan, const char *display, const char *chip_spec, const char *sensor)
 {
-    FILE *file = fopen(path, "r");
-    int value = -1;
+    char path[2 * BUFFER_SIZE], label[NAME_LENGTH];
+    int added = 0;
 
-    if (file && fscanf(file, "%d", &value) == 1)
-        fclose(file);
-    else
+    if (strcmp(chip_spec, "rapl") == 0)
     {
-        perror("Error reading file");
+        plan->has_rapl = true;
 
-        if (file) fclose(file);
+        return add_entry(plan, NULL, KIND_RAPL, display, -1);
     }
 
-    return value;
-}
-
-int get_nvme_device_model(const char *nvme_device, char *device_model, size_t size)
-{
-    char command[BUFFER_SIZE];
+    const struct chip *chip = find_chip(chip_spec);
 
-    snprintf(command, sizeof(command), "udevadm info --query=property --name=%sn1 | grep 'ID_MODEL='", nvme_device);
-    FILE *fp = popen(command, "r");
+    if (!chip)
+        return -1;
 
-    if (fp)
+    for (int kind = KIND_TEMP; kind <= KIND_VOLTAGE; kind++)
     {
-        char line[BUFFER_SIZE];
+        size_t prefix_len = strlen(kind_prefixes[kind]);
 
-        while (fgets(line, sizeof(line), fp))
-        {
-            if (strstr(line, "ID_MODEL=") != NULL)
-            {
-                char *start = strstr(line, "=");
+        if (strncmp(sensor, kind_prefixes[kind], prefix_len) != 0 || !isdigit((unsigned char)sensor[prefix_len]))
+            continue;
 
-                if (start)
-                {
-                    start++;
-                    strncpy(device_model, start, size);
+        snprintf(path, sizeof(path), "%s/%s%s", chip->path, sensor, strchr(sensor, '_') ? "" : "_input");
 
-                    device_model[strcspn(device_model, "\n")] = 0;
+        return add_entry(plan, path, kind, display, -1);
+    }
 
-                    pclose(fp);
+    int set = plan->num_sets++;
 
-                    return 0;
-                }
-            }
-        }
+    for (int kind = KIND_TEMP; kind <= KIND_VOLTAGE; kind++)
+    {
+        for (int channel = 0; channel <= MAX_CHANNELS; channel++)
+        {
+            snprintf(path, sizeof(path), "%s/%s%d_label", chip->path, kind_prefixes[kind], channel);
 
-        pclose(fp);
+            if (read_line(path, label, sizeof(label)) != 0 || fnmatch(sensor, label, FNM_CASEFOLD) != 0)
+                continue;
+
+            snprintf(path, sizeof(path), "%s/%s%d_input", chip->path, kind_prefixes[kind], channel);
+
+            if (add_entry(plan, path, kind, strcmp(display, "*") == 0 ? label : display, set) == 0)
+                added++;
+        }
     }
 
-    return -1;
+    return added ? 0 : -1;
 }
 
-int find_hwmon_path(const char *sensor_name, char *path, size_t size)
+static void add_group(struct read_plan *plan, char *title)
 {
-    char cmd[BUFFER_SIZE];
+    if (plan->num_groups >= MAX_GROUPS)
+        return;
 
-    snprintf(cmd, sizeof(cmd), "grep -l '%s' /sys/class/hwmon/hwmon*/name", sensor_name);
-    FILE *fp = popen(cmd, "r");
+    char *group = plan->groups[plan->num_groups++];
 
-    if (fp && fgets(path, size, fp))
+    if (strcmp(title, "$board") == 0)
     {
-        pclose(fp);
-
-        path[strcspn(path, "\n")] = 0;
-        size_t len = strlen(path);
+        if (read_line(BOARD_NAME_PATH, group, BUFFER_SIZE) != 0)
+            snprintf(group, BUFFER_SIZE, "Unknown Motherboard");
+    }
+    else if (strncmp(title, "$model:", 7) == 0)
+    {
+        const char *model_chip = title + 7;
+        const struct chip *chip = find_chip(model_chip);
 
-        if (len >= 5)
-            path[len - 5] = '\0';
+        if (chip && chip->model[0])
+            snprintf(group, BUFFER_SIZE, "%s", chip->model);
         else
-            path[0] = '\0';
-
-        return 0;
+            snprintf(group, BUFFER_SIZE, "%s", model_chip);
     }
-    if (fp) pclose(fp);
-    return -1;
+    else
+        snprintf(group, BUFFER_SIZE, "%s", title);
 }
 
-int find_nvme_hwmon_path(const char *nvme_device, char *hwmon_path, size_t max_len)
+static int build_plan(struct read_plan *plan, const char *config_file)
 {
-    char command[BUFFER_SIZE];
+    FILE *fp = fopen(config_file, "r");
+    char line[BUFFER_SIZE];
+    int number = 0;
+
+    if (!fp)
+        return -1;
 
-    snprintf(command, sizeof(command), "udevadm info --query=path %s", nvme_device);
-    FILE *fp = popen(command, "r");
+    discover_chips();
 
-    if (fp && fgets(hwmon_path, max_len, fp))
+    while (fgets(line, sizeof(line), fp))
     {
-        pclose(fp);
+        char *text = trim(line);
+        char chip_spec[NAME_LENGTH], sensor[NAME_LENGTH];
 
-        hwmon_path[strcspn(hwmon_path, "\n")] = 0;
+        number++;
 
-        snprintf(command, sizeof(command), "find /sys%s -type d -name 'hwmon*'", hwmon_path);
-        fp = popen(command, "r");
+        if (text[0] == '\0' || text[0] == '#')
+            continue;
 
-        if (fp && fgets(hwmon_path, max_len, fp))
+        if (text[0] == '[')
         {
-            pclose(fp);
+            text[strcspn(text, "]")] = '\0';
+            add_group(plan, trim(text + 1));
+
+            continue;
+        }
+
+        char *equals = strchr(text, '=');
 
-            hwmon_path[strcspn(hwmon_path, "\n")] = 0;
+        if (!equals || plan->num_groups == 0 || sscanf(equals + 1, "%31s %31s", chip_spec, sensor) != 2)
+        {
+            fprintf(stderr, "%s:%d: expected 'Display = chip sensor' inside a [group]\n", config_file, number);
 
-            return 0;
+            continue;
         }
 
-        if (fp) pclose(fp);
+        *equals = '\0';
+
+        // Missing hardware is not an error, the line just does not show up
+        resolve_sensor(plan, trim(text), chip_spec, sensor);
     }
 
-    return -1;
+    fclose(fp);
+
+    return 0;
+}
+
+static int64_t parse_int(const char *buffer, ssize_t len)
+{
+    int64_t value = 0;
+    bool negative = len > 0 && buffer[0] == '-';
+
+    for (ssize_t i = negative; i < len && buffer[i] >= '0' && buffer[i] <= '9'; i++)
+        value = value * 10 + (buffer[i] - '0');
+
+    return negative ? -value : value;
 }
 
-int read_board_name(char *board_name, size_t size)
+static void execute_plan(struct read_plan *plan)
 {
-    FILE *file = fopen(BOARD_NAME_PATH, "r");
+    char buffer[32];
 
-    if (file)
+    for (int i = 0; i < plan->num_entries; i++)
     {
-        if (fgets(board_name, size, file))
+        const struct plan_entry *entry = &plan->entries[i];
+
+        if (entry->kind == KIND_RAPL)
         {
-            board_name[strcspn(board_name, "\n")] = 0;
+            double watts = energy_watts(&previous_snapshot, &current_snapshot, -1);
 
-            fclose(file);
+            plan->values[i] = watts;
+            plan->valid[i] = watts >= 0;
 
-            return 0;
+            continue;
         }
 
-        fclose(file);
-    }
-
-    perror("Error reading board name file");
+        ssize_t len = pread(entry->fd, buffer, sizeof(buffer), 0);
 
-    return -1;
+        plan->valid[i] = len > 0;
+        plan->values[i] = len > 0 ? parse_int(buffer, len) * entry->scale : 0.0;
+    }
 }
 
-int main()
+static void print_plan(const struct read_plan *plan)
 {
-    char board_name[BUFFER_SIZE], hwmon_path[BUFFER_SIZE], nvme_device_model[BUFFER_SIZE], temp_path[BUFFER_SIZE];
-    int mobo_temp, vrm_temp, pch_temp;
-    int radiator_fan, top_fans, bottom1_fans, bottom2_fans;
-    int cpu_tctl, cpu_tccd;
-    float cpu_power = 0.0f, gpu_edge = 0.0f, gpu_junction = 0.0f, gpu_mem = 0.0f, gpu_power = 0.0f;
-    int nvme_temps[4] = {-1, -1, -1, -1};
-    int dram_temps[2] = {-1, -1};
-
-    if (find_hwmon_path("nct668*", hwmon_path, sizeof(hwmon_path)) == 0)
+    int group = -1;
+
+    for (int i = 0; i < plan->num_entries; i++)
     {
-        snprintf(temp_path, sizeof(temp_path), "%s/temp2_input", hwmon_path);
-        mobo_temp = read_int_from_file(temp_path);
+        const struct plan_entry *entry = &plan->entries[i];
+        bool hottest = false;
+        int set_size = 0;
 
-        snprintf(temp_path, sizeof(temp_path), "%s/temp3_input", hwmon_path);
-        vrm_temp = read_int_from_file(temp_path);
+        if (entry->group != group)
+        {
+            group = entry->group;
+            printf("\n" BOLD "%s" RESET "\n", plan->groups[group]);
+        }
 
-        snprintf(temp_path, sizeof(temp_path), "%s/temp4_input", hwmon_path);
-        pch_temp = read_int_from_file(temp_path);
+        // Within a glob set (e.g. every Tccd) the highest reading is shown in bold
+        if (entry->set >= 0)
+        {
+            hottest = true;
 
-        snprintf(temp_path, sizeof(temp_path), "%s/fan1_input", hwmon_path);
-        radiator_fan = read_int_from_file(temp_path);
+            for (int j = 0; j < plan->num_entries; j++)
+            {
+                if (plan->entries[j].set != entry->set)
+                    continue;
 
-        snprintf(temp_path, sizeof(temp_path), "%s/fan4_input", hwmon_path);
-        top_fans = read_int_from_file(temp_path);
+                set_size++;
 
-        snprintf(temp_path, sizeof(temp_path), "%s/fan5_input", hwmon_path);
-        bottom1_fans = read_int_from_file(temp_path);
+                if (plan->valid[j] && plan->values[j] > plan->values[i])
+                    hottest = false;
+            }
 
-        snprintf(temp_path, sizeof(temp_path), "%s/fan6_input", hwmon_path);
-        bottom2_fans = read_int_from_file(temp_path);
-    }
-    else
-    {
-        fprintf(stderr, "nct668* sensor module not found!\n");
+            hottest = hottest && set_size > 1;
+        }
 
-        return 1;
-    }
+        printf("%s%-9s: ", hottest ? BOLD : "", entry->name);
 
-    if (find_hwmon_path("k10temp", hwmon_path, sizeof(hwmon_path)) == 0)
-    {
-        snprintf(temp_path, sizeof(temp_path), "%s/temp1_input", hwmon_path);
-        cpu_tctl = read_int_from_file(temp_path);
+        double value = plan->valid[i] && plan->values[i] >= 0 ? plan->values[i] : 0.0;
 
-        snprintf(temp_path, sizeof(temp_path), "%s/temp3_input", hwmon_path);
-        cpu_tccd = read_int_from_file(temp_path);
+        switch (entry->kind)
+        {
+            case KIND_TEMP: printf("%.2f°C", value); break;
+            case KIND_FAN: printf("%d RPM", (int)value); break;
+            case KIND_VOLTAGE: printf("%.3f V", value); break;
+            default: printf("%.2f W", value); break;
+        }
 
-        cpu_power = calculate_cpu_power();
-    }
-    else
-    {
-        fprintf(stderr, "k10temp sensor module not found!\n");
+        printf("%s\n", hottest ? RESET : "");
 
-        return 1;
+        for (int s = 0; entry->kind == KIND_RAPL && energy.num_packages > 1 && s < energy.num_packages; s++)
+            printf("Socket %-2d: %.2f W\n", s, energy_watts(&previous_snapshot, &current_snapshot, s));
     }
+}
 
-    if (find_hwmon_path("amdgpu", hwmon_path, sizeof(hwmon_path)) == 0)
-    {
-        snprintf(temp_path, sizeof(temp_path), "%s/temp1_input", hwmon_path);
-        gpu_edge = read_int_from_file(temp_path);
+/*
+ * ~/.config/ryzen-power/sens.conf, then the sens.conf shipped next to the
+ * binary (through /proc/self/exe, so symlinks and any working directory
+ * work), then ./sens.conf.
+ */
+static const char *find_config(char *path, size_t size)
+{
+    snprintf(path, size, "%s" USER_CONFIG, getenv("HOME") ? getenv("HOME") : "");
 
-        snprintf(temp_path, sizeof(temp_path), "%s/temp2_input", hwmon_path);
-        gpu_junction = read_int_from_file(temp_path);
+    if (access(path, R_OK) == 0)
+        return path;
 
-        snprintf(temp_path, sizeof(temp_path), "%s/temp3_input", hwmon_path);
-        gpu_mem = read_int_from_file(temp_path);
+    ssize_t len = readlink("/proc/self/exe", path, size - 1);
 
-        snprintf(temp_path, sizeof(temp_path), "%s/power1_average", hwmon_path);
-        gpu_power = read_int_from_file(temp_path);
-    }
-    else
+    if (len > 0)
     {
-        fprintf(stderr, "amdgpu sensor module not found!\n");
+        path[len] = '\0';
 
-        return 1;
-    }
-
-    if (read_board_name(board_name, sizeof(board_name)) == 0)
-    {
-        printf("\n" BOLD "%s" RESET "\n", board_name);
-    }
-    else
-    {
-        printf(BOLD "Unknown Motherboard" RESET "\n");
-    }
+        char *slash = strrchr(path, '/');
 
-    printf("Mobo     : %.2f°C\n", mobo_temp >= 0 ? mobo_temp / 1000.0 : 0.0);
-    printf("VRM      : %.2f°C\n", vrm_temp >= 0 ? vrm_temp / 1000.0 : 0.0);
-    printf("Chipset  : %.2f°C\n", pch_temp >= 0 ? pch_temp / 1000.0 : 0.0);
-    printf("\n");
+        if (slash && (size_t)(slash + 1 - path) + sizeof(DEFAULT_CONFIG) <= size)
+        {
+            memcpy(slash + 1, DEFAULT_CONFIG, sizeof(DEFAULT_CONFIG));
 
-    printf(BOLD "AMD Ryzen 7 7800X3D" RESET "\n");
-    printf("Tctl     : %.2f°C\n", cpu_tctl >= 0 ? cpu_tctl / 1000.0 : 0.0);
-    printf("Tccd     : %.2f°C\n", cpu_tccd >= 0 ? cpu_tccd / 1000.0 : 0.0);
-    printf("Power    : %.2f W\n", cpu_power / USEC);
-    printf("\n");
+            if (access(path, R_OK) == 0)
+                return path;
+        }
+    }
 
-    printf(BOLD "AMD Radeon RX 6800 XT" RESET "\n");
-    printf("Edge     : %.2f°C\n", gpu_edge >= 0 ? gpu_edge / 1000.0 : 0.0);
-    printf("Junction : %.2f°C\n", gpu_junction >= 0 ? gpu_junction / 1000.0 : 0.0);
-    printf("Mem      : %.2f°C\n", gpu_mem >= 0 ? gpu_mem / 1000.0 : 0.0);
-    printf("Power    : %.2f W\n", gpu_power / USEC);
-    printf("\n");
+    return DEFAULT_CONFIG;
+}
 
-    printf(BOLD "G-SKILL Trident Z5 Neo" RESET "\n");
+int sens_main(int argc, char *argv[])
+{
+    static struct read_plan plan;
+    char default_config[BUFFER_SIZE];
+    const char *config_file = argc > 1 ? argv[1] : find_config(default_config, sizeof(default_config));
+    int interval_ms = argc > 2 ? atoi(argv[2]) : 0;
 
-    for (int i = 0; i < 2; i++)
+    if (build_plan(&plan, config_file) != 0)
     {
-        snprintf(hwmon_path, sizeof(hwmon_path), "/sys/class/hwmon/hwmon%d", 8 + i);
-
-        snprintf(temp_path, sizeof(temp_path), "%s/temp1_input", hwmon_path);
-        dram_temps[i] = read_int_from_file(temp_path);
+        fprintf(stderr, "Usage: %s [CONFIG] [INTERVAL_MS]\n", argv[0]);
+        perror(config_file);
 
-        printf("DRAM %d   : %.2f°C\n", i + 1, dram_temps[i] >= 0 ? dram_temps[i] / 1000.0 : 0.0);
+        return 1;
     }
 
-    printf("\n");
+    if (plan.has_rapl && energy_open(&energy) == 0)
+        energy_snapshot(&energy, &previous_snapshot);
 
-    for (int i = 0; i < 4; i++)
+    do
     {
-        char nvme_device[BUFFER_SIZE];
-
-        snprintf(nvme_device, sizeof(nvme_device), "/dev/nvme%d", i);
+        // Power needs an interval; without one sens keeps its one-second measurement
+        if (plan.has_rapl)
+            usleep(interval_ms > 0 ? interval_ms * 1000 : USEC);
+        else if (interval_ms > 0)
+            usleep(interval_ms * 1000);
 
-        if (find_nvme_hwmon_path(nvme_device, hwmon_path, sizeof(hwmon_path)) == 0)
-        {
-            snprintf(temp_path, sizeof(temp_path), "%s/temp1_input", hwmon_path);
-            nvme_temps[i] = read_int_from_file(temp_path);
+        if (energy.backend != ENERGY_NONE && energy_sample(&energy) == 0)
+            energy_snapshot(&energy, &current_snapshot);
 
-            if (get_nvme_device_model(nvme_device, nvme_device_model, sizeof(nvme_device_model)) == 0)
-                printf(BOLD "%s" RESET "\n", nvme_device_model);
-            else
-                printf(BOLD "NVMe %d: Model name not found" RESET "\n", i + 1);
+        execute_plan(&plan);
+        print_plan(&plan);
+        fflush(stdout);
 
-            printf("NAND     : %.2f°C\n", nvme_temps[i] >= 0 ? nvme_temps[i] / 1000.0 : 0.0);
-            printf("\n");
-        }
-        else
-            printf("Failed to find hwmon path for %s\n", nvme_device);
+        previous_snapshot = current_snapshot;
     }
-
-    printf(BOLD "Lian Li Lancool II" RESET "\n");
-    printf("Radiator : %d RPM\n", radiator_fan >= 0 ? radiator_fan : 0);
-    printf("Top      : %d RPM\n", top_fans >= 0 ? top_fans : 0);
-    printf("Bottom 1 : %d RPM\n", bottom1_fans >= 0 ? bottom1_fans : 0);
-    printf("Bottom 2 : %d RPM\n", bottom2_fans >= 0 ? bottom2_fans : 0);
+    while (interval_ms > 0);
 
     return 0;
 }
@@ -0,0 +1,170 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define USEC 1000000
+
+static const int64_t window_spans[STATS_WINDOWS] = { 1 * USEC, 10 * USEC, 60 * USEC, 300 * USEC };
+static const char *window_names[STATS_WINDOWS] = { "1s", "10s", "1m", "5m" };
+
+static int bucket_of(const struct rolling_stats *st, double value)
+{
+    int bucket = (int)((value - st->lo) * st->buckets / (st->hi - st->lo));
+
+    if (bucket < 0)
+        return 0;
+
+    return bucket >= st->buckets ? st->buckets - 1 : bucket;
+}
+
+static const struct stats_sample *sample_at(const struct rolling_window *win, uint64_t seq)
+{
+    return &win->samples[seq % win->capacity];
+}
+
+static void expire_oldest(const struct rolling_stats *st, struct rolling_window *win)
+{
+    const struct stats_sample *oldest = sample_at(win, win->head);
+
+    win->sum -= oldest->value;
+    win->histogram[bucket_of(st, oldest->value)]--;
+
+    if (win->min_head != win->min_tail && win->min_deque[win->min_head % win->capacity] == win->head)
+        win->min_head++;
+
+    if (win->max_head != win->max_tail && win->max_deque[win->max_head % win->capacity] == win->head)
+        win->max_head++;
+
+    win->head++;
+}
+
+static void window_push(const struct rolling_stats *st, struct rolling_window *win, int64_t usec, double value)
+{
+    while (win->head != win->tail && sample_at(win, win->head)->usec <= usec - win->span_usec)
+        expire_oldest(st, win);
+
+    // Sampling faster than stats_init() was told about: drop the oldest rather than grow
+    if (win->tail - win->head == win->capacity)
+        expire_oldest(st, win);
+
+    uint64_t seq = win->tail++;
+    struct stats_sample *slot = &win->samples[seq % win->capacity];
+
+    slot->usec = usec;
+    slot->value = value;
+    win->sum += value;
+    win->histogram[bucket_of(st, value)]++;
+
+    // Monotonic deques: the front is always the current extreme of the window
+    while (win->min_tail != win->min_head && sample_at(win, win->min_deque[(win->min_tail - 1) % win->capacity])->value >= value)
+        win->min_tail--;
+
+    win->min_deque[win->min_tail++ % win->capacity] = seq;
+
+    while (win->max_tail != win->max_head && sample_at(win, win->max_deque[(win->max_tail - 1) % win->capacity])->value <= value)
+        win->max_tail--;
+
+    win->max_deque[win->max_tail++ % win->capacity] = seq;
+}
+
+static double quantile(const struct rolling_stats *st, const struct rolling_window *win, size_t count, double q)
+{
+    size_t rank = (size_t)(q * (count - 1)) + 1;
+    size_t seen = 0;
+    double width = (st->hi - st->lo) / st->buckets;
+
+    for (int i = 0; i < st->buckets; i++)
+    {
+        seen += win->histogram[i];
+
+        if (seen >= rank)
+            return st->lo + (i + 0.5) * width;
+    }
+
+    return st->hi;
+}
+
+int stats_init(struct rolling_stats *st, double lo, double hi, int buckets, int64_t min_interval_usec)
+{
+    size_t total = 0;
+    size_t histogram_bytes = ((buckets + 1) & ~1) * sizeof(uint32_t);
+
+    if (hi <= lo || buckets <= 0 || min_interval_usec <= 0)
+        return -1;
+
+    memset(st, 0, sizeof(*st));
+    st->lo = lo;
+    st->hi = hi;
+    st->buckets = buckets;
+
+    for (int w = 0; w < STATS_WINDOWS; w++)
+    {
+        st->windows[w].span_usec = window_spans[w];
+        st->windows[w].capacity = window_spans[w] / min_interval_usec + 2;
+        total += st->windows[w].capacity * (sizeof(struct stats_sample) + 2 * sizeof(uint64_t)) + histogram_bytes;
+    }
+
+    char *memory = calloc(1, total);
+
+    if (!memory)
+        return -1;
+
+    st->memory = memory;
+
+    for (int w = 0; w < STATS_WINDOWS; w++)
+    {
+        struct rolling_window *win = &st->windows[w];
+
+        win->samples = (struct stats_sample *)memory;
+        memory += win->capacity * sizeof(struct stats_sample);
+        win->min_deque = (uint64_t *)memory;
+        memory += win->capacity * sizeof(uint64_t);
+        win->max_deque = (uint64_t *)memory;
+        memory += win->capacity * sizeof(uint64_t);
+        win->histogram = (uint32_t *)memory;
+        memory += histogram_bytes;
+    }
+
+    return 0;
+}
+
+void stats_free(struct rolling_stats *st)
+{
+    free(st->memory);
+    memset(st, 0, sizeof(*st));
+}
+
+void stats_push(struct rolling_stats *st, int64_t usec, double value)
+{
+    for (int w = 0; w < STATS_WINDOWS; w++)
+        window_push(st, &st->windows[w], usec, value);
+}
+
+void stats_get(const struct rolling_stats *st, enum stats_window window, struct stats_summary *out)
+{
+    const struct rolling_window *win = &st->windows[window];
+
+    memset(out, 0, sizeof(*out));
+    out->count = win->tail - win->head;
+
+    if (out->count == 0)
+        return;
+
+    out->min = sample_at(win, win->min_deque[win->min_head % win->capacity])->value;
+    out->max = sample_at(win, win->max_deque[win->max_head % win->capacity])->value;
+    out->mean = win->sum / out->count;
+    out->p95 = quantile(st, win, out->count, 0.95);
+    out->p99 = quantile(st, win, out->count, 0.99);
+
+    // Bucket midpoints can fall outside the exact extremes
+    if (out->p95 > out->max) out->p95 = out->max;
+    if (out->p99 > out->max) out->p99 = out->max;
+    if (out->p95 < out->min) out->p95 = out->min;
+    if (out->p99 < out->min) out->p99 = out->min;
+}
+
+const char *stats_window_name(enum stats_window window)
+{
+    return window_names[window];
+}
@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum stats_window
+{
+    STATS_1S,
+    STATS_10S,
+    STATS_1M,
+    STATS_5M,
+    STATS_WINDOWS
+};
+
+struct stats_sample
+{
+    int64_t usec;
+    double value;
+};
+
+struct rolling_window
+{
+    int64_t span_usec;
+    size_t capacity;
+    struct stats_sample *samples;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t *min_deque;
+    uint64_t min_head;
+    uint64_t min_tail;
+    uint64_t *max_deque;
+    uint64_t max_head;
+    uint64_t max_tail;
+    double sum;
+    uint32_t *histogram;
+};
+
+struct stats_summary
+{
+    size_t count;
+    double min;
+    double max;
+    double mean;
+    double p95;
+    double p99;
+};
+
+/*
+ * Rolling min/max/mean/p95/p99 over 1 s, 10 s, 1 min and 5 min windows.
+ * Everything is allocated by stats_init(), sized for one sample every
+ * min_interval_usec; stats_push() is O(1) (amortised for the min/max deques)
+ * and never allocates. Quantiles come from a fixed histogram over [lo, hi).
+ */
+struct rolling_stats
+{
+    double lo;
+    double hi;
+    int buckets;
+    struct rolling_window windows[STATS_WINDOWS];
+    void *memory;
+};
+
+int stats_init(struct rolling_stats *st, double lo, double hi, int buckets, int64_t min_interval_usec);
+void stats_free(struct rolling_stats *st);
+void stats_push(struct rolling_stats *st, int64_t usec, double value);
+void stats_get(const struct rolling_stats *st, enum stats_window window, struct stats_summary *out);
+const char *stats_window_name(enum stats_window window);
+
+#endif
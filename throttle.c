@@ -0,0 +1,165 @@
+#include "throttle.h"
+
+#include <string.h>
+
+#define USEC 1000000
+
+void throttle_default_config(struct throttle_config *config)
+{
+    config->tctl_limit = THROTTLE_DEFAULT_TCTL_LIMIT;
+    config->tctl_margin = 1.0;
+    config->power_limit = THROTTLE_DEFAULT_POWER_LIMIT;
+    config->power_margin = 0.03;
+    config->drop_fraction = 0.02;
+    config->busy_fraction = 0.5;
+}
+
+void throttle_init(struct throttle_detector *d, const struct throttle_config *config)
+{
+    memset(d, 0, sizeof(*d));
+    d->config = *config;
+}
+
+/*
+ * Off the limit the reference follows each core, so it holds the level from
+ * just before the limit. At the limit it only moves up, when a core runs
+ * faster than that level.
+ */
+static void track_reference(struct throttle_detector *d, const double *freq_mhz, int num_cores)
+{
+    for (int i = 0; i < num_cores; i++)
+    {
+        if (!d->at_limit || freq_mhz[i] > d->reference_mhz[i])
+            d->reference_mhz[i] = freq_mhz[i];
+    }
+}
+
+static bool close_episode(struct throttle_detector *d, struct throttle_episode *ended)
+{
+    d->episodes++;
+    d->total_lost_mhz_s += d->current.lost_mhz_s;
+    d->total_s += (double)(d->current.end_usec - d->current.start_usec) / USEC;
+    d->active = false;
+
+    if (ended)
+        *ended = d->current;
+
+    return true;
+}
+
+/*
+ * Feeds one sample; tctl or watts below zero mean "not available". Returns
+ * true and fills ended when this sample closed an episode. A sample stands for
+ * the interval since the previous one, so an episode runs from the sample
+ * before the first throttled one to the last throttled one.
+ */
+bool throttle_update(struct throttle_detector *d, int64_t usec, double tctl, double watts, const double *freq_mhz, int num_cores, struct throttle_episode *ended)
+{
+    const struct throttle_config *c = &d->config;
+    double dt = d->last_usec > 0 && usec > d->last_usec ? (double)(usec - d->last_usec) / USEC : 0.0;
+    double reference = 0.0, actual = 0.0, shortfall = 0.0, fastest = 0.0;
+    int reasons = 0, busy = 0;
+    bool closed = false;
+
+    if (num_cores > THROTTLE_MAX_CORES)
+        num_cores = THROTTLE_MAX_CORES;
+
+    // First sample, or the core count changed: start the references from here
+    if (num_cores != d->num_cores)
+    {
+        memcpy(d->reference_mhz, freq_mhz, num_cores * sizeof(*freq_mhz));
+        d->num_cores = num_cores;
+    }
+
+    if (tctl >= 0 && tctl >= c->tctl_limit - c->tctl_margin)
+        reasons |= THROTTLE_THERMAL;
+
+    if (watts >= 0 && c->power_limit > 0 && watts >= c->power_limit * (1.0 - c->power_margin))
+        reasons |= THROTTLE_POWER;
+
+    for (int i = 0; i < num_cores; i++)
+    {
+        if (d->reference_mhz[i] > fastest)
+            fastest = d->reference_mhz[i];
+    }
+
+    // Idle cores sit far below the fastest one, and a core far below its own reference has gone idle rather than been throttled
+    for (int i = 0; i < num_cores; i++)
+    {
+        if (d->reference_mhz[i] <= 0 || d->reference_mhz[i] < fastest * c->busy_fraction || freq_mhz[i] < d->reference_mhz[i] * c->busy_fraction)
+            continue;
+
+        reference += d->reference_mhz[i];
+        actual += freq_mhz[i];
+        busy++;
+
+        if (freq_mhz[i] < d->reference_mhz[i])
+            shortfall += d->reference_mhz[i] - freq_mhz[i];
+    }
+
+    int64_t previous_usec = d->last_usec;
+
+    d->at_limit = reasons != 0;
+    d->last_usec = usec;
+
+    track_reference(d, freq_mhz, num_cores);
+
+    if (!d->at_limit || reference <= 0 || shortfall < reference * c->drop_fraction)
+    {
+        if (d->active)
+            closed = close_episode(d, ended);
+
+        return closed;
+    }
+
+    if (!d->active)
+    {
+        memset(&d->current, 0, sizeof(d->current));
+        d->current.start_usec = previous_usec > 0 ? previous_usec : usec;
+        d->current.reference_mhz = reference / busy;
+        d->current.min_mhz = actual / busy;
+        d->active = true;
+    }
+
+    d->current.end_usec = usec;
+    d->current.reasons |= reasons;
+    d->current.lost_mhz_s += shortfall * dt;
+
+    if (tctl > d->current.peak_tctl)
+        d->current.peak_tctl = tctl;
+
+    if (watts > d->current.peak_watts)
+        d->current.peak_watts = watts;
+
+    if (actual / busy < d->current.min_mhz)
+        d->current.min_mhz = actual / busy;
+
+    return false;
+}
+
+// Closes an episode still open at the end of a trace or on exit
+bool throttle_finish(struct throttle_detector *d, struct throttle_episode *ended)
+{
+    return d->active && close_episode(d, ended);
+}
+
+const char *throttle_reason_name(int reasons)
+{
+    switch (reasons)
+    {
+        case THROTTLE_THERMAL: return "thermal";
+        case THROTTLE_POWER: return "power";
+        case THROTTLE_THERMAL | THROTTLE_POWER: return "thermal+power";
+        default: return "none";
+    }
+}
+
+// One JSON object per line, like the ryzen run log
+void throttle_log(FILE *file, const struct throttle_episode *e)
+{
+    fprintf(file, "{\"start_us\":%lld,\"end_us\":%lld,\"duration_s\":%.3f,\"reason\":\"%s\",\"lost_mhz_s\":%.1f,\"peak_tctl\":%.1f,\"peak_w\":%.1f,"
+            "\"reference_mhz\":%.0f,\"min_mhz\":%.0f}\n",
+            (long long)e->start_usec, (long long)e->end_usec, (double)(e->end_usec - e->start_usec) / USEC, throttle_reason_name(e->reasons), e->lost_mhz_s,
+            e->peak_tctl, e->peak_watts, e->reference_mhz, e->min_mhz);
+    fflush(file);
+}
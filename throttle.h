@@ -0,0 +1,76 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define THROTTLE_MAX_CORES 256
+
+// 7800X3D: Tjmax 89 °C, PPT 162 W
+#define THROTTLE_DEFAULT_TCTL_LIMIT 89.0
+#define THROTTLE_DEFAULT_POWER_LIMIT 162.0
+
+enum throttle_reason
+{
+    THROTTLE_THERMAL = 1,
+    THROTTLE_POWER = 2
+};
+
+struct throttle_config
+{
+    double tctl_limit;
+    double tctl_margin;
+    double power_limit;
+    double power_margin;
+    double drop_fraction;
+    double busy_fraction;
+};
+
+struct throttle_episode
+{
+    int64_t start_usec;
+    int64_t end_usec;
+    int reasons;
+    double lost_mhz_s;
+    double peak_tctl;
+    double peak_watts;
+    double reference_mhz;
+    double min_mhz;
+};
+
+/*
+ * Per-sample throttle detector. A sample is "at the limit" when Tctl is within
+ * tctl_margin degrees of tctl_limit or package power within power_margin
+ * (fraction) of power_limit. Each core's reference is its frequency in the
+ * last sample before the limit, raised while at the limit whenever the core
+ * runs faster. Only busy cores are charged: a reference within busy_fraction
+ * of the fastest core's and a clock within busy_fraction of that reference,
+ * so a core that was idle or has gone idle costs nothing. An episode is a run of at-limit samples where the busy cores
+ * together run at least drop_fraction below their references; lost
+ * MHz-seconds integrate that shortfall. Being at the limit at a steady clock
+ * is not an episode. Timestamps come from the caller, so live sampling and
+ * replayed traces run through the same code.
+ */
+struct throttle_detector
+{
+    struct throttle_config config;
+    double reference_mhz[THROTTLE_MAX_CORES];
+    int num_cores;
+    int64_t last_usec;
+    bool at_limit;
+    bool active;
+    struct throttle_episode current;
+    uint64_t episodes;
+    double total_lost_mhz_s;
+    double total_s;
+};
+
+void throttle_default_config(struct throttle_config *config);
+void throttle_init(struct throttle_detector *d, const struct throttle_config *config);
+bool throttle_update(struct throttle_detector *d, int64_t usec, double tctl, double watts, const double *freq_mhz, int num_cores, struct throttle_episode *ended);
+bool throttle_finish(struct throttle_detector *d, struct throttle_episode *ended);
+void throttle_log(FILE *file, const struct throttle_episode *episode);
+const char *throttle_reason_name(int reasons);
+
+#endif
@@ -0,0 +1,144 @@
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define USEC 1000000
+
+int64_t get_monotonicTimeUSec(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (int64_t)time.tv_sec * USEC + time.tv_nsec / 1000;
+}
+
+// One integer from a persistent sysfs fd, re-read from offset 0; -1 on failure
+int64_t read_int64_fd(int fd)
+{
+    char buffer[32];
+    ssize_t len = pread(fd, buffer, sizeof(buffer) - 1, 0);
+
+    if (len <= 0)
+        return -1;
+
+    buffer[len] = '\0';
+
+    return strtoll(buffer, NULL, 10);
+}
+
+int64_t read_int64_path(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    int64_t value = read_int64_fd(fd);
+
+    close(fd);
+
+    return value;
+}
+
+// First line of a small file, without the newline or trailing blanks
+int read_line(const char *path, char *buffer, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+
+    ssize_t len = read(fd, buffer, size - 1);
+
+    close(fd);
+
+    if (len <= 0)
+        return -1;
+
+    buffer[len] = '\0';
+    len = strcspn(buffer, "\n");
+    buffer[len] = '\0';
+
+    // Some devices pad their model names
+    while (len > 0 && isspace((unsigned char)buffer[len - 1]))
+        buffer[--len] = '\0';
+
+    return 0;
+}
+
+// Blank lines are skipped; returns the number of names or -1 if the file cannot be opened
+int load_process_names(const char *config_file, char process_list[MAX_PROCESSES][MAX_NAME_LENGTH])
+{
+    FILE *fp = fopen(config_file, "r");
+
+    if (!fp)
+        return -1;
+
+    char line[MAX_NAME_LENGTH];
+    int count = 0;
+
+    while (fgets(line, sizeof(line), fp) && count < MAX_PROCESSES)
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        if (line[0] == '\0')
+            continue;
+
+        snprintf(process_list[count++], MAX_NAME_LENGTH, "%s", line);
+    }
+
+    fclose(fp);
+
+    return count;
+}
+
+// Nonblocking IPv4 listener on addr:port
+int open_listener(const char *addr, int port, int backlog)
+{
+    struct sockaddr_in sa;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if (fd < 0)
+    {
+        perror("socket");
+
+        return -1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1)
+    {
+        fprintf(stderr, "Invalid listen address: %s\n", addr);
+
+        close(fd);
+
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, backlog) != 0)
+    {
+        perror("bind/listen");
+
+        close(fd);
+
+        return -1;
+    }
+
+    return fd;
+}
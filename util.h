@@ -0,0 +1,19 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Blacklist files: one process name per line, as in blacklisted_apps.conf
+#define MAX_PROCESSES 100
+#define MAX_NAME_LENGTH 256
+
+// Small helpers every tool in the multicall binary shares
+int64_t get_monotonicTimeUSec(void);
+int64_t read_int64_fd(int fd);
+int64_t read_int64_path(const char *path);
+int read_line(const char *path, char *buffer, size_t size);
+int load_process_names(const char *config_file, char process_list[MAX_PROCESSES][MAX_NAME_LENGTH]);
+int open_listener(const char *addr, int port, int backlog);
+
+#endif